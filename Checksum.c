@@ -0,0 +1,251 @@
+// Checksum.c
+// Checksum kernels used by the Segment ADT
+// The parity checksum only needs the XOR of every byte in a segment,
+// so it is computed a word (or vector register) at a time and folded
+// down to a single byte at the end. The widest kernel the CPU
+// supports is picked the first time it is needed.
+// CRC32C uses the SSE4.2 crc32 instruction when it is available,
+// and a slicing-by-8 table otherwise.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+#include "Checksum.h"
+
+// Buffers shorter than this (e.g. segment headers) aren't worth
+// the vector setup
+#define MIN_VECTOR_LENGTH 64
+
+// Reflected CRC32C polynomial
+#define CRC32C_POLY 0x82F63B78
+
+typedef uint64_t (*FoldFunction)(const unsigned char *buf, uint len);
+typedef uint (*CrcFunction)(uint crc, const unsigned char *buf, uint len);
+
+static FoldFunction chooseFold(void);
+static uint64_t foldScalar(const unsigned char *buf, uint len);
+
+static CrcFunction chooseCrc(void);
+static uint crcTable(uint crc, const unsigned char *buf, uint len);
+static void buildCrcTable(void);
+
+static uint crcTables[8][256];
+static pthread_once_t crcTablesBuilt = PTHREAD_ONCE_INIT;
+
+unsigned char xorBytes(const char *buf, uint len) {
+	static FoldFunction fold = NULL;
+	
+	uint64_t acc;
+	if (len < MIN_VECTOR_LENGTH) {
+		acc = foldScalar((const unsigned char *)buf, len);
+	} else {
+		FoldFunction f = __atomic_load_n(&fold, __ATOMIC_RELAXED);
+		if (f == NULL) {
+			f = chooseFold();
+			__atomic_store_n(&fold, f, __ATOMIC_RELAXED);
+		}
+		acc = f((const unsigned char *)buf, len);
+	}
+	
+	// Fold the 64-bit accumulator down to one byte
+	acc ^= acc >> 32;
+	acc ^= acc >> 16;
+	acc ^= acc >> 8;
+	return (unsigned char)acc;
+}
+
+uint crc32c(uint crc, const char *buf, uint len) {
+	static CrcFunction f = NULL;
+	
+	CrcFunction crcFunction = __atomic_load_n(&f, __ATOMIC_RELAXED);
+	if (crcFunction == NULL) {
+		crcFunction = chooseCrc();
+		__atomic_store_n(&f, crcFunction, __ATOMIC_RELAXED);
+	}
+	return crcFunction(crc, (const unsigned char *)buf, len);
+}
+
+// Byte positions within the accumulator don't matter, since
+// everything gets folded into one byte at the end
+static uint64_t foldScalar(const unsigned char *buf, uint len) {
+	uint64_t acc = 0;
+	uint i = 0;
+	
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, buf + i, sizeof(word));
+		acc ^= word;
+	}
+	for (; i < len; i++) {
+		acc ^= buf[i];
+	}
+	
+	return acc;
+}
+
+// Slicing-by-8: eight table lookups consume eight bytes at a time
+static uint crcTable(uint crc, const unsigned char *buf, uint len) {
+	pthread_once(&crcTablesBuilt, buildCrcTable);
+	uint i = 0;
+	
+	for (; i + 8 <= len; i += 8) {
+		uint lo, hi;
+		memcpy(&lo, buf + i, sizeof(lo));
+		memcpy(&hi, buf + i + 4, sizeof(hi));
+		lo ^= crc;
+		crc = crcTables[7][ lo        & 0xFF] ^ crcTables[6][(lo >>  8) & 0xFF] ^
+		      crcTables[5][(lo >> 16) & 0xFF] ^ crcTables[4][ lo >> 24        ] ^
+		      crcTables[3][ hi        & 0xFF] ^ crcTables[2][(hi >>  8) & 0xFF] ^
+		      crcTables[1][(hi >> 16) & 0xFF] ^ crcTables[0][ hi >> 24        ];
+	}
+	for (; i < len; i++) {
+		crc = crcTables[0][(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+	}
+	
+	return crc;
+}
+
+static void buildCrcTable(void) {
+	for (uint n = 0; n < 256; n++) {
+		uint crc = n;
+		for (int k = 0; k < 8; k++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : (crc >> 1);
+		}
+		crcTables[0][n] = crc;
+	}
+	for (uint n = 0; n < 256; n++) {
+		for (int t = 1; t < 8; t++) {
+			uint prev = crcTables[t - 1][n];
+			crcTables[t][n] = crcTables[0][prev & 0xFF] ^ (prev >> 8);
+		}
+	}
+}
+
+#ifdef X86_KERNELS
+
+__attribute__((target("sse4.2")))
+static uint crcSse42(uint crc, const unsigned char *buf, uint len) {
+	uint i = 0;
+	
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, buf + i, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint)crc64;
+#endif
+	for (; i + 4 <= len; i += 4) {
+		uint word;
+		memcpy(&word, buf + i, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for (; i < len; i++) {
+		crc = _mm_crc32_u8(crc, buf[i]);
+	}
+	
+	return crc;
+}
+
+__attribute__((target("sse2")))
+static uint64_t foldSse2(const unsigned char *buf, uint len) {
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	uint i = 0;
+	
+	for (; i + 32 <= len; i += 32) {
+		acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i *)(buf + i)));
+		acc1 = _mm_xor_si128(acc1, _mm_loadu_si128((const __m128i *)(buf + i + 16)));
+	}
+	for (; i + 16 <= len; i += 16) {
+		acc0 = _mm_xor_si128(acc0, _mm_loadu_si128((const __m128i *)(buf + i)));
+	}
+	
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(acc0, acc1));
+	return lanes[0] ^ lanes[1] ^ foldScalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t foldAvx2(const unsigned char *buf, uint len) {
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	uint i = 0;
+	
+	for (; i + 64 <= len; i += 64) {
+		acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i *)(buf + i)));
+		acc1 = _mm256_xor_si256(acc1, _mm256_loadu_si256((const __m256i *)(buf + i + 32)));
+	}
+	for (; i + 32 <= len; i += 32) {
+		acc0 = _mm256_xor_si256(acc0, _mm256_loadu_si256((const __m256i *)(buf + i)));
+	}
+	
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_xor_si256(acc0, acc1));
+	return lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3] ^
+	       foldScalar(buf + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static uint64_t foldAvx512(const unsigned char *buf, uint len) {
+	__m512i acc0 = _mm512_setzero_si512();
+	__m512i acc1 = _mm512_setzero_si512();
+	uint i = 0;
+	
+	for (; i + 128 <= len; i += 128) {
+		acc0 = _mm512_xor_si512(acc0, _mm512_loadu_si512(buf + i));
+		acc1 = _mm512_xor_si512(acc1, _mm512_loadu_si512(buf + i + 64));
+	}
+	for (; i + 64 <= len; i += 64) {
+		acc0 = _mm512_xor_si512(acc0, _mm512_loadu_si512(buf + i));
+	}
+	
+	uint64_t lanes[8];
+	_mm512_storeu_si512(lanes, _mm512_xor_si512(acc0, acc1));
+	uint64_t acc = 0;
+	for (int j = 0; j < 8; j++) {
+		acc ^= lanes[j];
+	}
+	return acc ^ foldScalar(buf + i, len - i);
+}
+
+static FoldFunction chooseFold(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return foldAvx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		return foldAvx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		return foldSse2;
+	}
+	return foldScalar;
+}
+
+static CrcFunction chooseCrc(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crcSse42;
+	}
+	return crcTable;
+}
+
+#else
+
+static FoldFunction chooseFold(void) {
+	return foldScalar;
+}
+
+static CrcFunction chooseCrc(void) {
+	return crcTable;
+}
+
+#endif
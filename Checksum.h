@@ -0,0 +1,18 @@
+// Checksum.h
+// Header file for the checksum kernels used by the Segment ADT
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+typedef unsigned int uint;
+
+// Returns the XOR of every byte in the buffer
+unsigned char xorBytes(const char *buf, uint len);
+
+// Extends a CRC32C (Castagnoli) over the buffer. Start with
+// crc = 0xFFFFFFFF and invert the final value.
+uint crc32c(uint crc, const char *buf, uint len);
+
+#endif
@@ -0,0 +1,308 @@
+// Congestion.c
+// Implementation of the Congestion ADT
+// The parts that every algorithm shares (slow start, fast recovery as
+// in NewReno, and falling back to one segment on a timeout) live here.
+// Each algorithm only has to say how the window grows outside of
+// recovery, and where the slow start threshold goes after a loss.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <err.h>
+#include <math.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Congestion.h"
+
+#define INITIAL_WINDOW 4    // Segments
+
+#define CUBIC_C        0.4
+#define CUBIC_BETA     0.7
+
+struct ccOps {
+	char   *name;
+	
+	// Grows the window outside of recovery. NULL for a fixed window.
+	void  (*increase)(Congestion cc, uint bytesAcked);
+	
+	// Returns the new slow start threshold after a loss
+	double (*onLoss)(Congestion cc, uint flight);
+};
+
+struct congestion {
+	const struct ccOps *ops;
+	double mss;
+	double mws;
+	
+	double cwnd;        // Bytes
+	double ssthresh;    // Bytes
+	double bytesAcked;  // Bytes acked since the window last grew in
+	                    // congestion avoidance
+	double maxIncrease; // Most one ACK grows the window by in slow start
+	int    inRecovery;
+	uint   recover;     // Recovery ends once this has been ACKed
+	double minRtt;      // Seconds (0 until the first sample)
+	
+	// CUBIC only (in segments and seconds)
+	double wMax;        // Window just before the last reduction
+	double origin;      // Window the cubic function plateaus at
+	double k;           // Time it takes to get back to the origin
+	double wEst;        // What Reno's window would be
+	double epochStart;  // Start of this congestion avoidance epoch
+	
+	sem_t  lock;
+};
+
+static void   slowStart(Congestion cc, uint bytesAcked);
+static void   renoIncrease(Congestion cc, uint bytesAcked);
+static double renoOnLoss(Congestion cc, uint flight);
+static void   cubicIncrease(Congestion cc, uint bytesAcked);
+static double cubicOnLoss(Congestion cc, uint flight);
+static double now(void);
+
+static const struct ccOps newRenoOps = { "newreno", renoIncrease, renoOnLoss };
+static const struct ccOps cubicOps = { "cubic", cubicIncrease, cubicOnLoss };
+static const struct ccOps fixedOps = { "none", NULL, NULL };
+
+static const struct ccOps *algorithms[] = { &newRenoOps, &cubicOps, &fixedOps };
+
+Congestion newCongestion(char *algorithm, uint mss, uint mws) {
+	const struct ccOps *ops = NULL;
+	for (int i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+		if (strcmp(algorithm, algorithms[i]->name) == 0) {
+			ops = algorithms[i];
+		}
+	}
+	if (ops == NULL) return NULL;
+	
+	Congestion cc = calloc(1, sizeof(struct congestion));
+	if (cc == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newCongestion)");
+	}
+	
+	cc->ops = ops;
+	cc->mss = mss;
+	cc->mws = (mws > mss ? mws : mss);
+	
+	cc->cwnd = fmin(INITIAL_WINDOW * cc->mss, cc->mws);
+	cc->ssthresh = cc->mws;
+	cc->maxIncrease = cc->mss;
+	cc->inRecovery = 0;
+	cc->minRtt = 0;
+	cc->epochStart = 0;
+	
+	sem_init(&(cc->lock), 0, 1);
+	
+	return cc;
+}
+
+void freeCongestion(Congestion cc) {
+	sem_destroy(&(cc->lock));
+	free(cc);
+}
+
+char *getCongestionName(Congestion cc) {
+	return cc->ops->name;
+}
+
+uint getCongestionWindow(Congestion cc) {
+	if (cc->ops->increase == NULL) {
+		return cc->mws;
+	}
+	
+	sem_wait(&(cc->lock));
+	uint cwnd = fmax(cc->mss, fmin(cc->cwnd, cc->mws));
+	sem_post(&(cc->lock));
+	return cwnd;
+}
+
+// With delayed ACKs, each ACK covers up to ackEvery segments, so slow
+// start counts the bytes ACKed up to that many segments (RFC 3465's
+// Appropriate Byte Counting, with L = ackEvery) rather than growing by
+// one segment per ACK
+void setSegmentsPerAck(Congestion cc, uint ackEvery) {
+	sem_wait(&(cc->lock));
+	cc->maxIncrease = (ackEvery > 0 ? ackEvery : 1) * cc->mss;
+	sem_post(&(cc->lock));
+}
+
+double getMinRtt(Congestion cc) {
+	sem_wait(&(cc->lock));
+	double minRtt = cc->minRtt;
+	sem_post(&(cc->lock));
+	return minRtt;
+}
+
+int inRecovery(Congestion cc) {
+	return cc->inRecovery;
+}
+
+int ccOnNewAck(Congestion cc, uint ackNo, uint bytesAcked) {
+	if (cc->ops->increase == NULL) return 0;
+	
+	int partialAck = 0;
+	sem_wait(&(cc->lock));
+	
+	if (!cc->inRecovery) {
+		cc->ops->increase(cc, bytesAcked);
+	
+	// A full ACK ends recovery, and the window deflates
+	// back down to the slow start threshold
+	} else if (ackNo > cc->recover) {
+		cc->cwnd = cc->ssthresh;
+		cc->inRecovery = 0;
+	
+	// A partial ACK means the next segment was lost too. Deflate by
+	// what was ACKed, but leave room to retransmit it.
+	} else {
+		cc->cwnd -= bytesAcked;
+		if (bytesAcked >= cc->mss) {
+			cc->cwnd += cc->mss;
+		}
+		partialAck = 1;
+	}
+	
+	// Don't let the window run away from what can actually be sent
+	cc->cwnd = fmin(cc->cwnd, cc->mws);
+	
+	sem_post(&(cc->lock));
+	return partialAck;
+}
+
+// Every duplicate ACK during recovery means a segment has left the
+// network, so another one can be sent
+void ccOnDupAck(Congestion cc) {
+	if (cc->ops->increase == NULL) return;
+	
+	sem_wait(&(cc->lock));
+	if (cc->inRecovery) {
+		cc->cwnd = fmin(cc->cwnd + cc->mss, cc->mws);
+	}
+	sem_post(&(cc->lock));
+}
+
+void ccOnFastRetransmit(Congestion cc, uint flight, uint recover) {
+	if (cc->ops->increase == NULL) return;
+	
+	sem_wait(&(cc->lock));
+	if (!cc->inRecovery) {
+		cc->ssthresh = cc->ops->onLoss(cc, flight);
+		cc->cwnd = cc->ssthresh + 3 * cc->mss;
+		cc->inRecovery = 1;
+		cc->recover = recover;
+	}
+	sem_post(&(cc->lock));
+}
+
+void ccOnTimeout(Congestion cc, uint flight) {
+	if (cc->ops->increase == NULL) return;
+	
+	sem_wait(&(cc->lock));
+	cc->ssthresh = cc->ops->onLoss(cc, flight);
+	cc->cwnd = cc->mss;
+	cc->bytesAcked = 0;
+	cc->inRecovery = 0;
+	sem_post(&(cc->lock));
+}
+
+void ccOnRttSample(Congestion cc, double rtt) {
+	sem_wait(&(cc->lock));
+	if (rtt > 0 && (cc->minRtt == 0 || rtt < cc->minRtt)) {
+		cc->minRtt = rtt;
+	}
+	sem_post(&(cc->lock));
+}
+
+// Below the slow start threshold, the window grows by the bytes
+// ACKed (up to maxIncrease per ACK), doubling every RTT
+static void slowStart(Congestion cc, uint bytesAcked) {
+	cc->cwnd += fmin(bytesAcked, cc->maxIncrease);
+}
+
+////////////////////////////////////////////////////////////////////////
+// NewReno
+
+// Grows by a segment per window's worth of ACKed bytes
+static void renoIncrease(Congestion cc, uint bytesAcked) {
+	if (cc->cwnd < cc->ssthresh) {
+		slowStart(cc, bytesAcked);
+		return;
+	}
+	
+	cc->bytesAcked += bytesAcked;
+	if (cc->bytesAcked >= cc->cwnd) {
+		cc->bytesAcked -= cc->cwnd;
+		cc->cwnd += cc->mss;
+	}
+}
+
+static double renoOnLoss(Congestion cc, uint flight) {
+	cc->bytesAcked = 0;
+	return fmax(flight / 2.0, 2 * cc->mss);
+}
+
+////////////////////////////////////////////////////////////////////////
+// CUBIC (RFC 8312)
+
+// Grows the window along a cubic function of the time since the last
+// loss, which is centred on the window at which that loss happened.
+// It never grows slower than Reno would.
+static void cubicIncrease(Congestion cc, uint bytesAcked) {
+	if (cc->cwnd < cc->ssthresh) {
+		slowStart(cc, bytesAcked);
+		return;
+	}
+	
+	double w = cc->cwnd / cc->mss;
+	double t = now();
+	
+	if (cc->epochStart == 0) {
+		cc->epochStart = t;
+		if (w < cc->wMax) {
+			cc->k = cbrt((cc->wMax - w) / CUBIC_C);
+			cc->origin = cc->wMax;
+		} else {
+			cc->k = 0;
+			cc->origin = w;
+		}
+		cc->wEst = w;
+	}
+	
+	double elapsed = t - cc->epochStart + cc->minRtt;
+	double d = elapsed - cc->k;
+	double target = cc->origin + CUBIC_C * d * d * d;
+	
+	double segmentsAcked = bytesAcked / cc->mss;
+	cc->wEst += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * segmentsAcked / w;
+	
+	target = fmax(target, cc->wEst);
+	target = fmin(target, 1.5 * w);
+	if (target > w) {
+		w += (target - w) / w * segmentsAcked;
+	}
+	cc->cwnd = w * cc->mss;
+}
+
+static double cubicOnLoss(Congestion cc, uint flight) {
+	double w = cc->cwnd / cc->mss;
+	
+	// If the window didn't get back to where it was before the
+	// last loss, release some bandwidth for other flows
+	if (w < cc->wMax) {
+		cc->wMax = w * (1 + CUBIC_BETA) / 2;
+	} else {
+		cc->wMax = w;
+	}
+	cc->epochStart = 0;
+	
+	return fmax(cc->cwnd * CUBIC_BETA, 2 * cc->mss);
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
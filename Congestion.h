@@ -0,0 +1,50 @@
+// Congestion.h
+// Header file for the Congestion ADT
+// Congestion control decides how much of the sender window may be in
+// flight at once, based on the ACKs, losses and RTT samples it is fed.
+// The algorithm is picked by name when the connection is set up.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+typedef struct congestion *Congestion;
+
+typedef unsigned int uint;
+
+// Algorithms: "newreno", "cubic", or "none" for a fixed window of
+// MWS bytes. Returns NULL if there is no such algorithm.
+Congestion newCongestion(char *algorithm, uint mss, uint mws);
+
+void freeCongestion(Congestion cc);
+
+char *getCongestionName(Congestion cc);
+
+// Returns how many bytes may be in flight
+uint getCongestionWindow(Congestion cc);
+
+// Each ACK can cover up to ackEvery segments
+void setSegmentsPerAck(Congestion cc, uint ackEvery);
+
+// Returns the shortest RTT sampled, or 0 if there hasn't been one
+double getMinRtt(Congestion cc);
+
+int inRecovery(Congestion cc);
+
+// An ACK acknowledged bytesAcked new bytes, up to ackNo. Returns 1 if
+// it was a partial ACK during recovery, in which case the segment at
+// ackNo was lost too and should be retransmitted straight away.
+int ccOnNewAck(Congestion cc, uint ackNo, uint bytesAcked);
+
+void ccOnDupAck(Congestion cc);
+
+// A segment is being fast retransmitted. flight is the number of
+// bytes in flight, and recover is the highest sequence no. sent.
+void ccOnFastRetransmit(Congestion cc, uint flight, uint recover);
+
+void ccOnTimeout(Congestion cc, uint flight);
+
+void ccOnRttSample(Congestion cc, double rtt);
+
+#endif
@@ -0,0 +1,174 @@
+// Pacer.c
+// Implementation of the Pacer ADT
+// Tokens (bytes) drip into the bucket at the pacing rate, and sending
+// takes them out. When the bucket runs dry, the sender sleeps on an
+// absolute deadline until a whole burst's worth has built up again,
+// rather than sleeping before every segment. A burst is at least
+// minBurst bytes, and at least a millisecond's worth at the current
+// rate, which keeps wakeups down when the rate is high.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <err.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Pacer.h"
+
+#define BURST_INTERVAL 0.001  // Seconds
+
+struct pacer {
+	double rate;        // Bytes per second (0 if not pacing)
+	double tokens;      // Bytes that can be sent right now
+	double burst;       // Most tokens the bucket can hold
+	uint   minBurst;
+	double lastRefill;  // Seconds
+	
+	// Statistics
+	double firstSend;   // Seconds (0 until something is sent)
+	double lastSend;
+	double bytesSent;
+	uint   numWaits;
+	
+	sem_t  lock;
+};
+
+static void   refill(Pacer pacer, double t);
+static double now(void);
+
+Pacer newPacer(uint minBurst) {
+	Pacer pacer = calloc(1, sizeof(struct pacer));
+	if (pacer == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newPacer)");
+	}
+	
+	pacer->rate = 0;
+	pacer->minBurst = minBurst;
+	pacer->burst = minBurst;
+	pacer->tokens = minBurst;
+	pacer->lastRefill = now();
+	
+	sem_init(&(pacer->lock), 0, 1);
+	
+	return pacer;
+}
+
+void setPacingRate(Pacer pacer, double bytesPerSecond) {
+	sem_wait(&(pacer->lock));
+	refill(pacer, now());
+	pacer->rate = bytesPerSecond;
+	pacer->burst = bytesPerSecond * BURST_INTERVAL;
+	if (pacer->burst < pacer->minBurst) {
+		pacer->burst = pacer->minBurst;
+	}
+	if (pacer->tokens > pacer->burst) {
+		pacer->tokens = pacer->burst;
+	}
+	sem_post(&(pacer->lock));
+}
+
+double getPacingRate(Pacer pacer) {
+	return pacer->rate;
+}
+
+double getAchievedRate(Pacer pacer) {
+	sem_wait(&(pacer->lock));
+	double elapsed = pacer->lastSend - pacer->firstSend;
+	double rate = (elapsed > 0 ? pacer->bytesSent / elapsed : 0);
+	sem_post(&(pacer->lock));
+	return rate;
+}
+
+void pace(Pacer pacer, uint bytes) {
+	sem_wait(&(pacer->lock));
+	double t = now();
+	refill(pacer, t);
+	
+	// Not enough tokens, so sleep until there is a whole burst
+	// (or at least enough for this segment)
+	if (pacer->rate > 0 && pacer->tokens < bytes) {
+		double wanted = (bytes > pacer->burst ? bytes : pacer->burst);
+		double wakeAt = t + (wanted - pacer->tokens) / pacer->rate;
+		pacer->numWaits++;
+		sem_post(&(pacer->lock));
+		
+		struct timespec deadline;
+		deadline.tv_sec = (time_t)wakeAt;
+		deadline.tv_nsec = (long)((wakeAt - deadline.tv_sec) * 1000000000);
+		// clock_nanosleep() returns the error rather than setting errno
+		int result;
+		do {
+			result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			                         &deadline, NULL);
+		} while (result == EINTR);
+		if (result != 0) {
+			errx(EXIT_FAILURE, "Failed to sleep (pace)");
+		}
+		
+		sem_wait(&(pacer->lock));
+		t = now();
+		refill(pacer, t);
+	}
+	
+	// The bucket can go into debt if the rate dropped while we slept
+	pacer->tokens -= bytes;
+	
+	if (pacer->firstSend == 0) {
+		pacer->firstSend = t;
+	}
+	pacer->lastSend = t;
+	pacer->bytesSent += bytes;
+	sem_post(&(pacer->lock));
+}
+
+int canSendNow(Pacer pacer, uint bytes) {
+	sem_wait(&(pacer->lock));
+	refill(pacer, now());
+	int canSend = (pacer->rate == 0 || pacer->tokens >= bytes);
+	sem_post(&(pacer->lock));
+	return canSend;
+}
+
+double getPacingDelay(Pacer pacer, uint bytes) {
+	sem_wait(&(pacer->lock));
+	refill(pacer, now());
+	double delay = 0;
+	if (pacer->rate > 0 && pacer->tokens < bytes) {
+		double wanted = (bytes > pacer->burst ? bytes : pacer->burst);
+		delay = (wanted - pacer->tokens) / pacer->rate;
+	}
+	sem_post(&(pacer->lock));
+	return delay;
+}
+
+void showPacer(Pacer pacer) {
+	double achieved = getAchievedRate(pacer);
+	sem_wait(&(pacer->lock));
+	printf("Pacer: rate %.0f bytes/s, achieved %.0f bytes/s, "
+	       "%.0f bytes sent, waited %d times\n",
+	       pacer->rate, achieved, pacer->bytesSent, pacer->numWaits);
+	sem_post(&(pacer->lock));
+}
+
+// Adds the tokens that have built up since the last refill.
+// Must be called with the lock held.
+static void refill(Pacer pacer, double t) {
+	if (pacer->rate > 0) {
+		pacer->tokens += (t - pacer->lastRefill) * pacer->rate;
+	} else {
+		pacer->tokens = pacer->burst;
+	}
+	if (pacer->tokens > pacer->burst) {
+		pacer->tokens = pacer->burst;
+	}
+	pacer->lastRefill = t;
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
@@ -0,0 +1,40 @@
+// Pacer.h
+// Header file for the Pacer ADT
+// A pacer spreads segments out at a given rate (a token bucket), so
+// that a window's worth of segments doesn't leave in one burst
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef PACER_H
+#define PACER_H
+
+typedef struct pacer *Pacer;
+
+typedef unsigned int uint;
+
+// minBurst is the fewest bytes the pacer lets out at once
+Pacer newPacer(uint minBurst);
+
+// A rate of 0 turns pacing off
+void setPacingRate(Pacer pacer, double bytesPerSecond);
+
+// Returns the rate the pacer is set to
+double getPacingRate(Pacer pacer);
+
+// Returns the rate that bytes have actually gone out at
+double getAchievedRate(Pacer pacer);
+
+// Waits until the given number of bytes can be sent
+void pace(Pacer pacer, uint bytes);
+
+// Returns 1 if pace would let the given number of bytes go
+// without waiting
+int canSendNow(Pacer pacer, uint bytes);
+
+// Returns how many seconds pace would wait before letting the given
+// number of bytes go (0 if it wouldn't wait)
+double getPacingDelay(Pacer pacer, uint bytes);
+
+void showPacer(Pacer pacer);
+
+#endif
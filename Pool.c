@@ -0,0 +1,161 @@
+// Pool.c
+// Implementation of the Pool ADT
+// Slots are carved out of slabs that are allocated as needed and
+// never given back, so a pool only grows to the most slots that were
+// ever in use at once (its high-water mark).
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <err.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Pool.h"
+
+#define SLOT_ALIGNMENT 16
+
+// A free slot holds the link to the next free slot
+struct freeSlot {
+	struct freeSlot *next;
+};
+
+struct pool {
+	uint             slotSize;
+	uint             slotsPerSlab;
+	struct freeSlot *freeList;
+	
+	char           **slabs;
+	uint             numSlabs;
+	uint             maxSlabs;  // Size of the slabs array
+	SlabHook         hook;
+	void            *hookArg;
+	uint             slotsInUse;
+	uint             highWaterMark;
+	uint             numTaken;  // Total number of slots ever taken
+	
+	sem_t            lock;
+};
+
+static void addSlab(Pool pool);
+
+Pool newPool(uint slotSize, uint slotsPerSlab) {
+	Pool pool = calloc(1, sizeof(struct pool));
+	if (pool == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newPool)");
+	}
+	
+	if (slotSize < sizeof(struct freeSlot)) {
+		slotSize = sizeof(struct freeSlot);
+	}
+	pool->slotSize = (slotSize + SLOT_ALIGNMENT - 1) & ~(SLOT_ALIGNMENT - 1);
+	pool->slotsPerSlab = (slotsPerSlab > 0 ? slotsPerSlab : 1);
+	pool->freeList = NULL;
+	
+	sem_init(&(pool->lock), 0, 1);
+	
+	return pool;
+}
+
+void freePool(Pool pool) {
+	for (uint i = 0; i < pool->numSlabs; i++) {
+		free(pool->slabs[i]);
+	}
+	free(pool->slabs);
+	sem_destroy(&(pool->lock));
+	free(pool);
+}
+
+void *takeSlot(Pool pool) {
+	sem_wait(&(pool->lock));
+	
+	if (pool->freeList == NULL) {
+		addSlab(pool);
+	}
+	struct freeSlot *slot = pool->freeList;
+	pool->freeList = slot->next;
+	
+	pool->slotsInUse++;
+	pool->numTaken++;
+	if (pool->slotsInUse > pool->highWaterMark) {
+		pool->highWaterMark = pool->slotsInUse;
+	}
+	
+	sem_post(&(pool->lock));
+	return slot;
+}
+
+void returnSlot(Pool pool, void *slot) {
+	struct freeSlot *freed = slot;
+	
+	sem_wait(&(pool->lock));
+	freed->next = pool->freeList;
+	pool->freeList = freed;
+	pool->slotsInUse--;
+	sem_post(&(pool->lock));
+}
+
+uint getSlotSize(Pool pool) {
+	return pool->slotSize;
+}
+
+uint getSlotsInUse(Pool pool) {
+	return pool->slotsInUse;
+}
+
+uint getHighWaterMark(Pool pool) {
+	return pool->highWaterMark;
+}
+
+void setSlabHook(Pool pool, SlabHook hook, void *arg) {
+	sem_wait(&(pool->lock));
+	pool->hook = hook;
+	pool->hookArg = arg;
+	if (hook != NULL) {
+		for (uint i = 0; i < pool->numSlabs; i++) {
+			hook(arg, pool->slabs[i],
+			     (unsigned long)pool->slotSize * pool->slotsPerSlab);
+		}
+	}
+	sem_post(&(pool->lock));
+}
+
+void showPool(Pool pool, char *name) {
+	sem_wait(&(pool->lock));
+	printf("Pool %s: %d-byte slots, %d slabs (%d slots), "
+	       "%d in use, high-water mark %d, %d taken in total\n",
+	       name, pool->slotSize, pool->numSlabs,
+	       pool->numSlabs * pool->slotsPerSlab, pool->slotsInUse,
+	       pool->highWaterMark, pool->numTaken);
+	sem_post(&(pool->lock));
+}
+
+// Allocates a new slab and threads all of its slots onto the
+// freelist. Must be called with the lock held.
+static void addSlab(Pool pool) {
+	char *slab;
+	if (posix_memalign((void **)&slab, SLOT_ALIGNMENT,
+			(size_t)pool->slotSize * pool->slotsPerSlab)) {
+		errx(EXIT_FAILURE, "Insufficient memory! (addSlab)");
+	}
+	
+	for (uint i = 0; i < pool->slotsPerSlab; i++) {
+		struct freeSlot *slot = (struct freeSlot *)(slab + i * pool->slotSize);
+		slot->next = pool->freeList;
+		pool->freeList = slot;
+	}
+	
+	if (pool->numSlabs == pool->maxSlabs) {
+		pool->maxSlabs = (pool->maxSlabs > 0 ? 2 * pool->maxSlabs : 8);
+		pool->slabs = realloc(pool->slabs, pool->maxSlabs * sizeof(char *));
+		if (pool->slabs == NULL) {
+			errx(EXIT_FAILURE, "Insufficient memory! (addSlab)");
+		}
+	}
+	pool->slabs[pool->numSlabs++] = slab;
+	
+	if (pool->hook != NULL) {
+		pool->hook(pool->hookArg, slab,
+		           (unsigned long)pool->slotSize * pool->slotsPerSlab);
+	}
+}
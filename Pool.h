@@ -0,0 +1,40 @@
+// Pool.h
+// Header file for the Pool ADT
+// A pool hands out fixed-size slots carved out of larger slabs, and
+// recycles freed slots through a freelist, so that the per-packet
+// paths don't have to go through malloc and free
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct pool *Pool;
+
+typedef unsigned int uint;
+
+// Called with every slab a pool has, as soon as it has it
+typedef void (*SlabHook)(void *arg, void *slab, unsigned long size);
+
+Pool newPool(uint slotSize, uint slotsPerSlab);
+
+// Frees every slab, so none of the pool's slots may be used afterwards
+void freePool(Pool pool);
+
+void *takeSlot(Pool pool);
+
+void returnSlot(Pool pool, void *slot);
+
+uint getSlotSize(Pool pool);
+
+uint getSlotsInUse(Pool pool);
+
+uint getHighWaterMark(Pool pool);
+
+void showPool(Pool pool, char *name);
+
+// Calls hook on every slab the pool already has, and then on each new
+// slab as it is added. Pass NULL to stop.
+void setSlabHook(Pool pool, SlabHook hook, void *arg);
+
+#endif
@@ -2,64 +2,293 @@
 // Implementation of the Queue ADT
 // The queue enables proper coordination of threads and allows
 // threads to be very localised in their functionality.
+// The queue is a bounded ring of cells, each stamped with a sequence
+// number so producers and consumers can claim cells without a lock
+// (Vyukov's bounded queue). Threads that find the queue empty or full
+// sleep on an eventfd, which is only written to when somebody is
+// actually asleep on it.
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
-#include <semaphore.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "Queue.h"
 
-struct node {
-	void        *item;
-	struct node *next;
+#define CACHE_LINE 64
+
+struct cell {
+	uint  seq;
+	void *item;
 };
 
 struct queue {
-	struct node *head;
-	struct node *tail;
-	int          size;
-	sem_t       *lock;
+	struct cell *cells;
+	uint         mask;
+	int          isSpsc;  // Positions can be claimed without a CAS
+	
+	// Producers and consumers each get their own cache line
+	uint         head __attribute__((aligned(CACHE_LINE)));
+	uint         tail __attribute__((aligned(CACHE_LINE)));
+	
+	int          itemsFd __attribute__((aligned(CACHE_LINE)));
+	int          itemsWaiters;
+	int          spaceFd;
+	int          spaceWaiters;
 };
 
-Queue newQueue(void) {
-	Queue new = calloc(1, sizeof(struct queue));
-	new->lock = malloc(sizeof(sem_t));
-	sem_init(new->lock, 0, 1);
+static Queue createQueue(uint capacity, int isSpsc);
+static int   pushItem(Queue q, void *item);
+static int   popItem(Queue q, void **item);
+static int   hasItems(Queue q);
+static void  announceWaiter(int *waiters);
+static void  retireWaiter(void *waiters);
+static void  sleepOn(int fd, int *waiters);
+static void  wakeWaiters(int fd, int *waiters, uint n);
+
+Queue newQueue(uint capacity) {
+	return createQueue(capacity, 0);
+}
+
+Queue newSpscQueue(uint capacity) {
+	return createQueue(capacity, 1);
+}
+
+static Queue createQueue(uint capacity, int isSpsc) {
+	Queue new;
+	if (posix_memalign((void **)&new, CACHE_LINE, sizeof(struct queue))) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newQueue)");
+	}
+	
+	// Round the capacity up to a power of two so positions
+	// can be mapped to cells with a mask
+	uint size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	
+	new->cells = malloc(size * sizeof(struct cell));
+	if (new->cells == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newQueue)");
+	}
+	for (uint i = 0; i < size; i++) {
+		new->cells[i].seq = i;
+		new->cells[i].item = NULL;
+	}
+	new->mask = size - 1;
+	new->isSpsc = isSpsc;
+	new->head = 0;
+	new->tail = 0;
+	
+	new->itemsFd = eventfd(0, EFD_SEMAPHORE);
+	new->spaceFd = eventfd(0, EFD_SEMAPHORE);
+	if (new->itemsFd < 0 || new->spaceFd < 0) {
+		errx(EXIT_FAILURE, "eventfd() failed (newQueue)");
+	}
+	new->itemsWaiters = 0;
+	new->spaceWaiters = 0;
+	
 	return new;
 }
 
+void freeQueue(Queue q) {
+	close(q->itemsFd);
+	close(q->spaceFd);
+	free(q->cells);
+	free(q);
+}
+
 void enterQueue(Queue q, void *item) {
-	struct node *new = malloc(sizeof(*new));
-	new->item = item;
-	new->next = NULL;
+	while (!tryEnterQueue(q, item)) {
+		// The queue is full, so push back on the producer. Check
+		// again after announcing ourselves in case a consumer made
+		// space before it could see us.
+		announceWaiter(&(q->spaceWaiters));
+		int entered = tryEnterQueue(q, item);
+		if (!entered) {
+			sleepOn(q->spaceFd, &(q->spaceWaiters));
+		}
+		retireWaiter(&(q->spaceWaiters));
+		if (entered) return;
+	}
+}
+
+int tryEnterQueue(Queue q, void *item) {
+	if (!pushItem(q, item)) {
+		return 0;
+	}
+	wakeWaiters(q->itemsFd, &(q->itemsWaiters), 1);
+	return 1;
+}
+
+void *leaveQueue(Queue q) {
+	void *item;
+	leaveQueueBatch(q, &item, 1);
+	return item;
+}
+
+uint leaveQueueBatch(Queue q, void *items[], uint max) {
+	while (!popItem(q, &items[0])) {
+		announceWaiter(&(q->itemsWaiters));
+		int left = popItem(q, &items[0]);
+		if (!left) {
+			sleepOn(q->itemsFd, &(q->itemsWaiters));
+		}
+		retireWaiter(&(q->itemsWaiters));
+		if (left) break;
+	}
 	
-	sem_wait(q->lock);
+	// Drain whatever else is already there without sleeping
+	uint n = 1;
+	while (n < max && popItem(q, &items[n])) {
+		n++;
+	}
 	
-	if (q->size == 0) {
-		q->head = new;
-	} else {
-		q->tail->next = new;
+	wakeWaiters(q->spaceFd, &(q->spaceWaiters), n);
+	return n;
+}
+
+uint tryLeaveQueueBatch(Queue q, void *items[], uint max) {
+	uint n = 0;
+	while (n < max && popItem(q, &items[n])) {
+		n++;
 	}
-	q->tail = new;
-	q->size++;
 	
-	sem_post(q->lock);
+	if (n > 0) {
+		wakeWaiters(q->spaceFd, &(q->spaceWaiters), n);
+	}
+	return n;
 }
 
-void *leaveQueue(Queue q) {
-	while (q->size == 0);
+// Same handshake as leaveQueueBatch: announce, then check again
+int prepareToWait(Queue q) {
+	announceWaiter(&(q->itemsWaiters));
+	if (hasItems(q)) {
+		retireWaiter(&(q->itemsWaiters));
+		return -1;
+	}
+	return q->itemsFd;
+}
+
+void finishWaiting(Queue q) {
+	retireWaiter(&(q->itemsWaiters));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Lock-free ring
+
+// A cell is free for the producer at position pos when its sequence
+// no. is pos, and holds an item for the consumer at position pos when
+// its sequence no. is pos + 1.
+static int pushItem(Queue q, void *item) {
+	struct cell *cell;
+	uint pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
 	
-	sem_wait(q->lock);
+	while (1) {
+		cell = &(q->cells[pos & q->mask]);
+		uint seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		int diff = (int)(seq - pos);
+		
+		if (diff == 0) {
+			if (q->isSpsc) {
+				__atomic_store_n(&(q->head), pos + 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (__atomic_compare_exchange_n(&(q->head), &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;  // Full
+		} else {
+			pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+		}
+	}
 	
-	struct node *first = q->head;
-	q->head = first->next;
-	void *item = first->item;
-	free(first);
-	q->size--;
+	cell->item = item;
+	__atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int popItem(Queue q, void **item) {
+	struct cell *cell;
+	uint pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
 	
-	sem_post(q->lock);
-	return item;
+	while (1) {
+		cell = &(q->cells[pos & q->mask]);
+		uint seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		int diff = (int)(seq - (pos + 1));
+		
+		if (diff == 0) {
+			if (q->isSpsc) {
+				__atomic_store_n(&(q->tail), pos + 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (__atomic_compare_exchange_n(&(q->tail), &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;  // Empty
+		} else {
+			pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+		}
+	}
+	
+	*item = cell->item;
+	__atomic_store_n(&(cell->seq), pos + q->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int hasItems(Queue q) {
+	uint pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+	struct cell *cell = &(q->cells[pos & q->mask]);
+	uint seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+	return (int)(seq - (pos + 1)) >= 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Sleeping and waking
+
+// The fences pair up with the one in wakeWaiters: either the waiter
+// sees the other side's update when it re-checks the ring, or the
+// other side sees the waiter and writes to the eventfd.
+static void announceWaiter(int *waiters) {
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
+static void retireWaiter(void *waiters) {
+	__atomic_sub_fetch((int *)waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+// read() is a cancellation point, so threads blocked on an empty
+// queue can still be cancelled during teardown
+static void sleepOn(int fd, int *waiters) {
+	uint64_t count;
+	pthread_cleanup_push(retireWaiter, waiters);
+	if (read(fd, &count, sizeof(count)) < 0) {
+		errx(EXIT_FAILURE, "Failed to wait on queue");
+	}
+	pthread_cleanup_pop(0);
+}
+
+// Wakes up to n sleeping threads. Each write of the eventfd's counter
+// lets one more reader through, since it is in semaphore mode.
+static void wakeWaiters(int fd, int *waiters, uint n) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int nWaiters = __atomic_load_n(waiters, __ATOMIC_RELAXED);
+	if (nWaiters > 0) {
+		uint64_t count = (n < nWaiters) ? n : nWaiters;
+		if (write(fd, &count, sizeof(count)) < 0) {
+			errx(EXIT_FAILURE, "Failed to wake up queue waiter");
+		}
+	}
+}
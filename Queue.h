@@ -9,11 +9,41 @@
 
 typedef struct queue *Queue;
 
-Queue newQueue(void);
+typedef unsigned int uint;
 
+// Bounded queue that any number of threads may enter and leave
+Queue newQueue(uint capacity);
+
+// Bounded queue with exactly one producer thread and one
+// consumer thread
+Queue newSpscQueue(uint capacity);
+
+// Nobody may be using the queue. Items still on it aren't freed.
+void freeQueue(Queue q);
+
+// Blocks while the queue is full
 void enterQueue(Queue q, void *item);
 
+// Returns 0 (and does not enqueue the item) if the queue is full
+int tryEnterQueue(Queue q, void *item);
+
+// Blocks while the queue is empty
 void *leaveQueue(Queue q);
 
-#endif
+// Blocks while the queue is empty, then takes up to max items off
+// the queue in one go. Returns the number of items taken.
+uint leaveQueueBatch(Queue q, void *items[], uint max);
 
+// Takes up to max items off the queue without blocking. Returns the
+// number of items taken (possibly 0).
+uint tryLeaveQueueBatch(Queue q, void *items[], uint max);
+
+// For a consumer that waits on other things as well as the queue.
+// Marks the caller as waiting for items and returns an eventfd that is
+// written to when items arrive. Returns -1 instead if there are items
+// already. Each wait that returns a fd must end with finishWaiting.
+int prepareToWait(Queue q);
+
+void finishWaiting(Queue q);
+
+#endif
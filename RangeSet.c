@@ -0,0 +1,123 @@
+// RangeSet.c
+// Implementation of the RangeSet ADT
+// The ranges are kept in an array sorted by their first byte, and
+// ranges that touch are merged, so a lookup is a binary search
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "RangeSet.h"
+
+#define INITIAL_CAPACITY 16
+
+struct range {
+	uint start;
+	uint end;    // One past the last byte
+};
+
+struct rangeSet {
+	struct range *ranges;
+	uint          nRanges;
+	uint          capacity;
+};
+
+static uint findRange(RangeSet set, uint byte);
+static void removeRanges(RangeSet set, uint i, uint n);
+
+RangeSet newRangeSet(void) {
+	RangeSet set = malloc(sizeof(struct rangeSet));
+	if (set == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newRangeSet)");
+	}
+	set->ranges = malloc(INITIAL_CAPACITY * sizeof(struct range));
+	if (set->ranges == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newRangeSet)");
+	}
+	set->nRanges = 0;
+	set->capacity = INITIAL_CAPACITY;
+	return set;
+}
+
+void freeRangeSet(RangeSet set) {
+	free(set->ranges);
+	free(set);
+}
+
+void addRange(RangeSet set, uint start, uint end) {
+	if (start >= end) return;
+	
+	// Merge with every range that overlaps or touches the new one
+	uint i = findRange(set, start);
+	if (i > 0 && set->ranges[i - 1].end >= start) {
+		i--;
+	}
+	uint j = i;
+	while (j < set->nRanges && set->ranges[j].start <= end) {
+		if (set->ranges[j].start < start) start = set->ranges[j].start;
+		if (set->ranges[j].end > end) end = set->ranges[j].end;
+		j++;
+	}
+	
+	if (j > i) {
+		removeRanges(set, i + 1, j - i - 1);
+	} else {
+		if (set->nRanges == set->capacity) {
+			set->capacity *= 2;
+			set->ranges = realloc(set->ranges,
+			                      set->capacity * sizeof(struct range));
+			if (set->ranges == NULL) {
+				errx(EXIT_FAILURE, "Insufficient memory! (addRange)");
+			}
+		}
+		memmove(&set->ranges[i + 1], &set->ranges[i],
+		        (set->nRanges - i) * sizeof(struct range));
+		set->nRanges++;
+	}
+	set->ranges[i].start = start;
+	set->ranges[i].end = end;
+}
+
+int inRangeSet(RangeSet set, uint byte) {
+	uint i = findRange(set, byte + 1);
+	return (i > 0 && set->ranges[i - 1].end > byte);
+}
+
+uint takeRangeFrom(RangeSet set, uint from) {
+	uint i = findRange(set, from + 1);
+	if (i > 0 && set->ranges[i - 1].end > from) {
+		from = set->ranges[i - 1].end;
+	}
+	removeRanges(set, 0, i);
+	return from;
+}
+
+uint getNumRanges(RangeSet set) {
+	return set->nRanges;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// Returns the index of the first range that starts at or after byte
+static uint findRange(RangeSet set, uint byte) {
+	uint lo = 0;
+	uint hi = set->nRanges;
+	while (lo < hi) {
+		uint mid = (lo + hi) / 2;
+		if (set->ranges[mid].start < byte) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Removes n ranges, starting from the one at index i
+static void removeRanges(RangeSet set, uint i, uint n) {
+	memmove(&set->ranges[i], &set->ranges[i + n],
+	        (set->nRanges - i - n) * sizeof(struct range));
+	set->nRanges -= n;
+}
@@ -0,0 +1,33 @@
+// RangeSet.h
+// Header file for the RangeSet ADT
+// A range set keeps track of which bytes of a stream have arrived as
+// a sorted list of disjoint ranges, so that it only grows with the
+// number of gaps rather than with the number of bytes
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef RANGE_SET_H
+#define RANGE_SET_H
+
+typedef struct rangeSet *RangeSet;
+
+typedef unsigned int uint;
+
+RangeSet newRangeSet(void);
+
+void freeRangeSet(RangeSet set);
+
+// Adds the bytes from start up to (but not including) end
+void addRange(RangeSet set, uint start, uint end);
+
+// Returns 1 if the given byte is in the set
+int inRangeSet(RangeSet set, uint byte);
+
+// Takes every byte before from out of the set, along with the range
+// that carries on from it, if there is one. Returns the first byte
+// after that range (or from, if no range touches it).
+uint takeRangeFrom(RangeSet set, uint from);
+
+uint getNumRanges(RangeSet set);
+
+#endif
@@ -28,6 +28,7 @@ struct receiverLogger {
 	uint numCorruptedSegments;
 	uint numDuplicateSegments;
 	uint numDuplicateAcksSent;
+	uint numAcksSaved;
 };
 
 static double getTime(ReceiverLogger logger);
@@ -65,8 +66,9 @@ void logEvent(ReceiverLogger logger, Event e, Segment s) {
 	        getSeqNo(s), getDataLength(s), getAckNo(s));
 	
 	if (e & RECEIVED) {
+		// The data in a SYN is just its options
 		int dataLength = getDataLength(s);
-		if (dataLength > 0) {
+		if (dataLength > 0 && !hasFlag(s, SYN)) {
 			logger->amountDataReceived += dataLength;
 			logger->dataSegmentsReceived++;
 		}
@@ -86,6 +88,10 @@ void logEvent(ReceiverLogger logger, Event e, Segment s) {
 	sem_post(&(logger->lock));
 }
 
+void logAcksSaved(ReceiverLogger logger, uint numAcksSaved) {
+	logger->numAcksSaved = numAcksSaved;
+}
+
 void logSummary(ReceiverLogger logger) {
 	fprintf(logger->log,
 		"\n"
@@ -96,6 +102,7 @@ void logSummary(ReceiverLogger logger) {
 		"Data segments with bit errors   %14d\n"
 		"Duplicate data segments received%14d\n"
 		"Duplicate ACKs sent             %14d\n"
+		"ACKs saved by delaying them     %14d\n"
 		"==============================================\n"
 		"\n",
 		
@@ -104,12 +111,18 @@ void logSummary(ReceiverLogger logger) {
 		logger->dataSegmentsReceived,
 		logger->numCorruptedSegments,
 		logger->numDuplicateSegments,
-		logger->numDuplicateAcksSent
+		logger->numDuplicateAcksSent,
+		logger->numAcksSaved
 	);
 	
 	fclose(logger->log);
 }
 
+void freeReceiverLogger(ReceiverLogger logger) {
+	sem_destroy(&(logger->lock));
+	free(logger);
+}
+
 static double getTime(ReceiverLogger logger) {
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -32,7 +32,13 @@ ReceiverLogger newReceiverLogger(char *filename);
 
 void logEvent(ReceiverLogger logger, Event e, Segment s);
 
+// Notes the number of ACKs that delaying ACKs saved, for the summary
+void logAcksSaved(ReceiverLogger logger, uint numAcksSaved);
+
 void logSummary(ReceiverLogger logger);
 
+// Frees the logger once logSummary has closed its log
+void freeReceiverLogger(ReceiverLogger logger);
+
 #endif
 
@@ -4,18 +4,32 @@
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
 #include <err.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "Queue.h"
+#include "RangeSet.h"
 #include "ReceiverLogger.h"
 #include "ReceiverSocket.h"
 #include "ReceiverSTP.h"
 #include "Segment.h"
 
+#define QUEUE_CAPACITY 1024
+#define BATCH_SIZE       64
+#define SLOTS_PER_SLAB   64
+#define LOG_NAME_LENGTH  64
+#define STREAM_WINDOWS    4  // Size of the stream, in windows
+#define MAX_ACK_EVERY    16
+#define MAX_ACK_DELAY    50  // ms, half of the sender's smallest RTO
+
 typedef unsigned int uint;
 
 struct receiverSTP {
@@ -25,12 +39,67 @@ struct receiverSTP {
 	Queue          rqueue;
 	uint           lastSeqNo;
 	uint           windowSize;
-	char          *dataBuffer;
-	uint           dataLength;
+	uint           mss;
+	Pool           dataPool;  // MSS-sized slots for data segments
+	Pool           ackPool;   // Header-only slots for ACKs
+	
+	// In-order segments waiting for the application, which borrows
+	// their data in place. handleData counts the bytes it adds at the
+	// tail and the application counts the bytes it gives back at the
+	// head (both from the start of the transfer), so neither has to
+	// wait for the other. The free space is the window we advertise.
+	Queue          stream;
+	uint           streamCapacity;
+	unsigned long long streamHead;
+	unsigned long long streamTail;
+	
+	Segment        borrowed[BATCH_SIZE];  // Lent to the application
+	int            nBorrowed;
+	int            finished;  // The application has taken the FIN
+	
+	// While the stream is holding the window back, handleData sets
+	// wantsRoom and the application writes to roomFd when it makes
+	// room, so that handleData can move on any segments that were
+	// waiting for it and tell the sender the window is open again
+	int            roomFd;
+	int            wantsRoom;
+	uint           lastWindow;  // The window in the last ACK sent
+	
+	// Out-of-order segments, one MSS-sized slot each, so that a
+	// segment can be put away, found again, or taken out in order in
+	// constant time. The sender cuts the data into MSS-sized segments,
+	// so a window's worth of them never share a slot.
+	Segment       *ring;
+	uint           nSlots;
+	
+	// With a file sink, segments are written straight to their place
+	// in the file instead of going through the ring and the stream
+	int            sinkFd;   // -1 if there isn't a file sink
+	RangeSet       written;  // Bytes after recvBase that are written
+	Segment        fin;      // Held until everything before it is written
 	uint           recvBase;
+	uint           checksumType;  // CRC32C if agreed on, otherwise 0
+	uint           timestamps;    // TIMESTAMPS if agreed on, otherwise 0
+	uint           tsRecent;      // The timestamp to echo
+	uint           lastAckNo;     // The ACK no. of the last ACK sent
+	int            useUring;      // Receive and reply through io_uring
+	int            attached;      // A server delivers the segments
+	uint           connId;        // Echoed back in every reply
+	char           logName[LOG_NAME_LENGTH];
+	unsigned long long offset;    // Where the data goes in the whole file
+	
+	Segment        acks[BATCH_SIZE];  // ACKs waiting to be sent together
+	int            nAcks;
 	
-	sem_t          canFetch;
-	sem_t          received;
+	// In-order segments are only ACKed every ackEvery segments, or
+	// once the first of them has waited ackDelay ms
+	uint           ackEvery;
+	uint           ackDelay;
+	Segment        delayed;   // The first segment whose ACK is held back
+	uint           nDelayed;
+	long long      ackDue;    // When the held back ACK must go (in ms)
+	uint           gapEnd;    // Just past the furthest out-of-order data
+	uint           numAcksSaved;
 	
 	pthread_t      receiveDataThread;
 	pthread_t      handleDataThread;
@@ -41,44 +110,245 @@ static void *receiveData(void *arg);
 static void *handleData(void *arg);
 
 // Helper fuctions
-static int checksumIsCorrect(Segment s);
-static int dupSegmentReceived(int nSegments, Segment buffer[],
-                              int recvBase, Segment s);
-static void insertInOrder(int nSegments, Segment buffer[], Segment s);
-static int getNumInOrderSegments(int nSegments, Segment buffer[]);
-static int getInOrderDataLength(int nInOrderSegments, Segment buffer[]);
-static void copyToDataBuffer(ReceiverSTP rstp, int nInOrderSegments,
-                             Segment buffer[]);
+static ReceiverSTP createSTP(ReceiverSocket rsock, char *logName);
+static Segment receiveControl(ReceiverSTP rstp, uint maxDataLength);
+static void replyControl(ReceiverSTP rstp, Segment s);
+static int checksumIsCorrect(ReceiverSTP rstp, Segment s);
+static void sendAck(ReceiverSTP rstp, uint ackNo, Segment s, Event e);
+static void flushAcks(ReceiverSTP rstp);
+static int delayAck(ReceiverSTP rstp, Segment s);
+static int waitForSegments(ReceiverSTP rstp, uint recvBase, void *batch[]);
+static int needsRoom(ReceiverSTP rstp, uint recvBase);
+static int roomWasMade(ReceiverSTP rstp, uint recvBase);
+static int windowHasOpened(ReceiverSTP rstp);
+static void stopWaiting(void *arg);
+static long long getTimeMs(void);
+static int dupSegmentReceived(ReceiverSTP rstp, uint recvBase, Segment s);
+static uint ringSlot(ReceiverSTP rstp, uint seqNo);
+static int putInRing(ReceiverSTP rstp, Segment s);
+static Segment nextInRing(ReceiverSTP rstp, uint recvBase);
+static uint drainInOrder(ReceiverSTP rstp, uint recvBase, int *finReceived);
+static uint getStreamSpace(ReceiverSTP rstp);
+static void writeToSink(ReceiverSTP rstp, Segment s);
+static uint drainWritten(ReceiverSTP rstp, uint recvBase, int *finReceived);
 
 ReceiverSTP newSTP(int recvPort) {
-	ReceiverSTP rstp = malloc(sizeof(struct receiverSTP));
+	ReceiverSTP rstp = createSTP(newSocket(recvPort), "Receiver_log.txt");
+	enableReceiveOffload(rstp->rsock);
+	return rstp;
+}
+
+// A connection that doesn't read its own socket: a server receives
+// every segment on the port and delivers this connection's segments
+// to it with deliverToSTP. Replies go out through rsock, which should
+// be a peer socket for the sender.
+ReceiverSTP newAttachedSTP(ReceiverSocket rsock, char *logName) {
+	ReceiverSTP rstp = createSTP(rsock, logName);
+	rstp->attached = 1;
+	return rstp;
+}
+
+static ReceiverSTP createSTP(ReceiverSocket rsock, char *logName) {
+	ReceiverSTP rstp = calloc(1, sizeof(struct receiverSTP));
 	if (rstp == NULL) {
 		errx(EXIT_FAILURE, "Insufficient memory!");
 	}
-	rstp->rsock = newSocket(recvPort);
+	rstp->rsock = rsock;
+	snprintf(rstp->logName, LOG_NAME_LENGTH, "%s", logName);
 	
-	rstp->rqueue = newQueue();
-	rstp->dataBuffer = NULL;
-	
-	sem_init(&(rstp->canFetch), 0, 0);
-	sem_init(&(rstp->received), 0, 0);
+	rstp->rqueue = newSpscQueue(QUEUE_CAPACITY);
+	rstp->dataPool = NULL;
+	rstp->stream = NULL;
+	rstp->streamHead = 0;
+	rstp->streamTail = 0;
+	rstp->nBorrowed = 0;
+	rstp->finished = 0;
+	rstp->roomFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (rstp->roomFd < 0) {
+		errx(EXIT_FAILURE, "eventfd() failed (newSTP)");
+	}
+	rstp->wantsRoom = 0;
+	rstp->lastWindow = 0;
+	rstp->ring = NULL;
+	rstp->nSlots = 0;
+	rstp->sinkFd = -1;
+	rstp->written = NULL;
+	rstp->fin = NULL;
+	rstp->nAcks = 0;
+	rstp->ackEvery = 1;
+	rstp->ackDelay = 0;
+	rstp->delayed = NULL;
+	rstp->nDelayed = 0;
+	rstp->gapEnd = 1;
+	rstp->tsRecent = NO_TIMESTAMP;
+	rstp->lastAckNo = 1;
+	rstp->numAcksSaved = 0;
+	rstp->useUring = 0;
+	rstp->attached = 0;
 	
 	return rstp;
 }
 
-int pullDataFromSTP(ReceiverSTP rstp, char **dataBuffer) {
-	sem_wait(&(rstp->canFetch));
+// Hands an attached connection a datagram of size bytes that the
+// server received for it. The connection keeps its own copy, in its
+// data pool once it has one. Returns 0 if the datagram was too short
+// for the data length it claims, or if the connection has fallen too
+// far behind to take it.
+int deliverToSTP(ReceiverSTP rstp, Segment s, int size) {
+	if (size < getHeaderSize() ||
+			getDataLength(s) > size - getHeaderSize()) {
+		return 0;
+	}
+	
+	// The pool is made during the handshake, on another thread
+	Segment copy;
+	Pool pool = __atomic_load_n(&(rstp->dataPool), __ATOMIC_ACQUIRE);
+	if (pool != NULL && getDataLength(s) <= rstp->mss) {
+		copy = newEmptySegment(pool, rstp->mss);
+	} else {
+		copy = newEmptySegment(NULL, getDataLength(s));
+	}
+	memcpy(copy, s, getHeaderSize() + getDataLength(s));
+	
+	if (!tryEnterQueue(rstp->rqueue, copy)) {
+		freeSegment(copy);
+		return 0;
+	}
+	return 1;
+}
+
+// Frees an attached connection once it has been torn down, and once
+// nothing can deliver to it any more
+void freeSTP(ReceiverSTP rstp) {
+	void *batch[BATCH_SIZE];
+	uint n;
+	while ((n = tryLeaveQueueBatch(rstp->rqueue, batch, BATCH_SIZE)) > 0) {
+		for (uint i = 0; i < n; i++) {
+			freeSegment(batch[i]);
+		}
+	}
+	freeQueue(rstp->rqueue);
+	
+	// Segments still in the stream (or lent out) go back to the pool
+	// before it goes
+	releaseDataToSTP(rstp);
+	if (rstp->stream != NULL) {
+		while ((n = tryLeaveQueueBatch(rstp->stream, batch,
+		                               BATCH_SIZE)) > 0) {
+			for (uint i = 0; i < n; i++) {
+				freeSegment(batch[i]);
+			}
+		}
+		freeQueue(rstp->stream);
+	}
+	
+	freeSegment(rstp->fin);
+	freeSegment(rstp->delayed);
+	
+	// As do the segments still waiting in the ring
+	if (rstp->ring != NULL) {
+		for (uint i = 0; i < rstp->nSlots; i++) {
+			if (rstp->ring[i] != NULL) {
+				freeSegment(rstp->ring[i]);
+			}
+		}
+		free(rstp->ring);
+	}
+	
+	freePool(rstp->dataPool);
+	freePool(rstp->ackPool);
+	freeReceiverLogger(rstp->rlogger);
+	closeSocket(rstp->rsock);
+	
+	close(rstp->roomFd);
+	if (rstp->written != NULL) {
+		freeRangeSet(rstp->written);
+	}
+	free(rstp);
+}
+
+// Has segments received and ACKs sent through io_uring, if the kernel
+// supports it, once the connection is established. Its receives use
+// MSS-sized buffers, so the kernel can't coalesce segments any more.
+void requestUring(ReceiverSTP rstp) {
+	rstp->useUring = 1;
+	disableReceiveOffload(rstp->rsock);
+}
+
+// Must be called before the connection is established. Each segment
+// is written to fd at its place in the transfer (after the range
+// offset, if there is one) as soon as it arrives, however far out of
+// order it is, so the receiver doesn't have to hold on to it. The
+// application lends nothing, and only waits for borrowDataFromSTP to
+// return 0 once the whole file is written.
+void setFileSink(ReceiverSTP rstp, int fd) {
+	rstp->sinkFd = fd;
+}
+
+void setLogName(ReceiverSTP rstp, char *logName) {
+	snprintf(rstp->logName, LOG_NAME_LENGTH, "%s", logName);
+}
+
+// Once the connection is established, returns where the sender said
+// its data goes in the file, if it is sending one range of a file
+// striped over several connections (otherwise 0)
+unsigned long long getRangeOffset(ReceiverSTP rstp) {
+	return rstp->offset;
+}
+
+// Lends the application the data of up to maxIov in-order segments,
+// waiting until there is some if there is none. Each piece of iov
+// points straight into the segment it arrived in, and stays valid
+// until releaseDataToSTP. Returns the number of pieces, or 0 (with
+// nothing borrowed) once the sender has finished.
+int borrowDataFromSTP(ReceiverSTP rstp, struct iovec iov[], int maxIov) {
+	if (maxIov > BATCH_SIZE) maxIov = BATCH_SIZE;
+	
+	int nIov = 0;
+	while (nIov == 0 && !rstp->finished) {
+		releaseDataToSTP(rstp);
+		rstp->nBorrowed = leaveQueueBatch(rstp->stream,
+		                                  (void **)rstp->borrowed, maxIov);
+		for (int i = 0; i < rstp->nBorrowed; i++) {
+			Segment s = rstp->borrowed[i];
+			if (hasFlag(s, FIN)) {
+				rstp->finished = 1;
+			}
+			if (getDataLength(s) > 0) {
+				iov[nIov].iov_base = getDataPortion(s);
+				iov[nIov].iov_len = getDataLength(s);
+				nIov++;
+			}
+		}
+	}
 	
-	int length = rstp->dataLength;
-	char *data = malloc(length * sizeof(char));
-	if (data == NULL) {
-		errx(EXIT_FAILURE, "Insufficient memory! (pullDataFromSTP)");
+	if (nIov == 0) {
+		releaseDataToSTP(rstp);
+	}
+	return nIov;
+}
+
+// Gives back everything borrowed with borrowDataFromSTP, which makes
+// room in the stream (and so in the window). Wakes handleData if it
+// is waiting for room.
+void releaseDataToSTP(ReceiverSTP rstp) {
+	uint length = 0;
+	for (int i = 0; i < rstp->nBorrowed; i++) {
+		length += getDataLength(rstp->borrowed[i]);
+		freeSegment(rstp->borrowed[i]);
 	}
-	memcpy(data, rstp->dataBuffer, length);
-	*dataBuffer = data;
+	rstp->nBorrowed = 0;
+	if (length == 0) return;
 	
-	sem_post(&(rstp->received));
-	return length;
+	// Pairs with the handshake in waitForSegments: either handleData
+	// sees the room, or we see that it wants to hear about it
+	__atomic_add_fetch(&(rstp->streamHead), length, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&(rstp->wantsRoom), 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(rstp->roomFd, &one, sizeof(one)) < 0) {
+			errx(EXIT_FAILURE, "Failed to wake up handleData");
+		}
+	}
 }
 
 // Thread for receiving data. This is as minimal as possible
@@ -86,216 +356,508 @@ int pullDataFromSTP(ReceiverSTP rstp, char **dataBuffer) {
 // firing at us.
 static void *receiveData(void *arg) {
 	ReceiverSTP rstp = (ReceiverSTP)arg;
-	uint bufferSize = rstp->windowSize + getHeaderSize();
-	Segment s = malloc(bufferSize * sizeof(char));
-	if (s == NULL) {
-		errx(EXIT_FAILURE, "Insufficient memory! (receiveData)");
-	}
-	int segmentSize;
+	uint bufferSize = rstp->mss + getHeaderSize();
+	Segment batch[BATCH_SIZE];
+	int sizes[BATCH_SIZE];
 	
-	// When we receive a segment, make a copy of it and then
-	// add it to the segment queue
+	// Receive a batch of segments straight into slots from the data
+	// pool, and add them to the segment queue. Datagrams that are too
+	// short for the data length they claim to have are thrown away,
+	// and their slots are reused for the next batch.
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		batch[i] = newEmptySegment(rstp->dataPool, rstp->mss);
+	}
 	while (1) {
-		segmentSize = receiveSocket(rstp->rsock, bufferSize, s);
-		Segment copy = malloc(segmentSize * sizeof(char));
-		if (copy == NULL) {
-			errx(EXIT_FAILURE, "Insufficient memory! (receiveData)");
+		int n = receiveSocketBatch(rstp->rsock, bufferSize, batch, sizes,
+		                           BATCH_SIZE);
+		for (int i = 0; i < n; i++) {
+			Segment s = batch[i];
+			if (sizes[i] < getHeaderSize() ||
+					getDataLength(s) > sizes[i] - getHeaderSize()) {
+				continue;
+			}
+			enterQueue(rstp->rqueue, s);
+			batch[i] = newEmptySegment(rstp->dataPool, rstp->mss);
 		}
-		memcpy(copy, s, segmentSize);
-		enterQueue(rstp->rqueue, copy);
 	}
 	
 	return NULL;
 }
 
 // Pulls segments off the queue and decides what to do with
-// them.
+// them. Every segment is ACKed as it is handled (unless delayed
+// ACKs were agreed on), but the data is only handed to the
+// application once per batch. If the stream fills up, in-order
+// segments wait in the ring until the application makes room, which
+// wakes this thread to take them and to send a window update.
 static void *handleData(void *arg) {
 	ReceiverSTP rstp = (ReceiverSTP)arg;
 	
-	int recvBase = 1;
-	Segment buffer[rstp->windowSize];
-	int nSegments = 0;
+	uint recvBase = 1;
+	void *batch[BATCH_SIZE];
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	
 	while (1) {
-		// leaveQueue blocks if theres nothing in the queue
-		Segment s = leaveQueue(rstp->rqueue);
-		printf("Received: seq no. %d\n", getSeqNo(s));
-		// Calculate the  checksum to see if the segment is
-		// corrupted
-		if (!checksumIsCorrect(s)) {
-			logEvent(rstp->rlogger, RECEIVED | CORRUPTED_DATA, s);
-			freeSegment(s);
-			continue;
-		}
+		// The thread can only be cancelled while it waits, so the
+		// ACK for the FIN always goes out, even though the
+		// application can see the FIN (and start the teardown) as
+		// soon as it is on the stream.
+		int n = waitForSegments(rstp, recvBase, batch);
 		
-		// If we received a duplicate segment, ACK recvBase
-		if (dupSegmentReceived(nSegments, buffer, recvBase, s)) {
-			printf("Duplicate segment received, ACK %d\n", recvBase);
-			logEvent(rstp->rlogger, RECEIVED | DUPLICATE_DATA, s);
-			freeSegment(s);
-			
-			Segment ack = newSegment(1, recvBase, 0, 0, ACK, NULL);
-			logEvent(rstp->rlogger, SENT | DUPLICATE_ACK, ack);
-			replySocket(rstp->rsock, 0, ack);
-			freeSegment(ack);
-			continue;
-		}
+		// Segments that come into order go on to the stream straight
+		// away, which wakes the application if it is waiting
+		int finReceived = 0;
+		unsigned long long tail = rstp->streamTail;
+		uint base = recvBase;
+		recvBase = drainInOrder(rstp, recvBase, &finReceived);
 		
-		// Insert the segment into the buffer in order with
-		// insertion sort
-		logEvent(rstp->rlogger, RECEIVED, s);
-		insertInOrder(nSegments, buffer, s);
-		nSegments++;
+		// Nothing came, so either the held back ACK is due (it covers
+		// all of the segments that were held back), or the application
+		// made room and the sender should hear about it
+		if (n == 0 && rstp->delayed != NULL) {
+			printf("Delayed ACK %d\n", recvBase);
+			rstp->numAcksSaved--;
+			sendAck(rstp, recvBase, rstp->delayed, SENT);
+		} else if (n == 0 && (recvBase != base || windowHasOpened(rstp))) {
+			printf("Window update, ACK %d\n", recvBase);
+			sendAck(rstp, recvBase, NULL, SENT);
+		}
 		
-		// If the segment has the next expected byte (i.e.,
-		// recvBase)
-		if (getSeqNo(s) == recvBase) {
-			
-			int nInOrderSegments = getNumInOrderSegments(nSegments,
-			                                             buffer);
-			int dataLength = getInOrderDataLength(nInOrderSegments,
-			                                      buffer);
-			printf("There are now %d inorder segments, containing "
-			       "%d bytes of data in total\n", nInOrderSegments,
-			       dataLength);
-			
-			free(rstp->dataBuffer);
-			rstp->dataBuffer = malloc(dataLength);
-			copyToDataBuffer(rstp, nInOrderSegments, buffer);
-			rstp->dataLength = dataLength;
+		for (int i = 0; i < n; i++) {
+			Segment s = batch[i];
+			printf("Received: seq no. %d\n", getSeqNo(s));
+			// Calculate the  checksum to see if the segment is
+			// corrupted
+			if (!checksumIsCorrect(rstp, s)) {
+				logEvent(rstp->rlogger, RECEIVED | CORRUPTED_DATA, s);
+				freeSegment(s);
+				continue;
+			}
 			
-			sem_post(&(rstp->canFetch));
-			sem_wait(&(rstp->received));
+			// If we received a duplicate segment, ACK recvBase
+			if (dupSegmentReceived(rstp, recvBase, s)) {
+				printf("Duplicate segment received, ACK %d\n", recvBase);
+				logEvent(rstp->rlogger, RECEIVED | DUPLICATE_DATA, s);
+				sendAck(rstp, recvBase, s, SENT | DUPLICATE_ACK);
+				freeSegment(s);
+				continue;
+			}
 			
-			recvBase = getSeqNo(buffer[nInOrderSegments - 1]) +
-			           getDataLength(buffer[nInOrderSegments - 1]);
-			if (hasFlag(s, FIN)) recvBase++;
-			for (int i = 0; i < nSegments - nInOrderSegments; i++) {
-				buffer[i] = buffer[i + nInOrderSegments];
+			// The sender never has more than a window in flight, so
+			// anything past it can't be real
+			if (getSeqNo(s) - recvBase >= rstp->windowSize) {
+				printf("Beyond the window, ACK %d\n", recvBase);
+				sendAck(rstp, recvBase, s, SENT | DUPLICATE_ACK);
+				freeSegment(s);
+				continue;
 			}
-			nSegments -= nInOrderSegments;
 			
-			printf("ACK %d\n", recvBase);
-			Segment ack = newSegment(1, recvBase, 0, 0, ACK, NULL);
-			logEvent(rstp->rlogger, SENT, ack);
-			replySocket(rstp->rsock, 0, ack);
-			freeSegment(ack);
+			// Put the segment in its slot in the ring, which keeps a
+			// reference of its own (we still need the segment to ACK it),
+			// or write it out if there is a file sink
+			logEvent(rstp->rlogger, RECEIVED, s);
+			if (rstp->sinkFd >= 0) {
+				writeToSink(rstp, s);
+			} else if (!putInRing(rstp, s)) {
+				printf("No room in the ring, ACK %d\n", recvBase);
+				sendAck(rstp, recvBase, s, SENT | DUPLICATE_ACK);
+				freeSegment(s);
+				continue;
+			}
 			
-		// If the segment is out of order (its sequence no.
-		// is greater than recvBase), ACK recvBase
-		} else {
-			printf("Out of order, ACK %d\n", recvBase);
+			// If the segment has the next expected byte (i.e.,
+			// recvBase), take everything that is now in order. As in
+			// RFC 5681, one that fills in (part of) a gap is ACKed
+			// straight away, since the sender is waiting to hear
+			// about it before it can send much more.
+			if (getSeqNo(s) == recvBase) {
+				int fillsGap = ((int)(rstp->gapEnd - recvBase) > 0);
+				recvBase = drainInOrder(rstp, recvBase, &finReceived);
+				if (!fillsGap) rstp->gapEnd = recvBase;
+				
+				if (!finReceived && !fillsGap && delayAck(rstp, s)) {
+					printf("Holding back ACK %d\n", recvBase);
+				} else {
+					printf("ACK %d\n", recvBase);
+					sendAck(rstp, recvBase, s, SENT);
+				}
 			
-			// Duplicate ACK
-			Segment ack = newSegment(1, recvBase, 0, 0, ACK, NULL);
-			logEvent(rstp->rlogger, SENT | DUPLICATE_ACK, ack);
-			replySocket(rstp->rsock, 0, ack);
-			freeSegment(ack);
+			// If the segment is out of order (its sequence no.
+			// is greater than recvBase), ACK recvBase
+			} else {
+				printf("Out of order, ACK %d\n", recvBase);
+				uint end = getSeqNo(s) + getDataLength(s);
+				if ((int)(end - rstp->gapEnd) > 0) {
+					rstp->gapEnd = end;
+				}
+				
+				// Duplicate ACK
+				sendAck(rstp, recvBase, s, SENT | DUPLICATE_ACK);
+			}
+			freeSegment(s);
 		}
 		
+		flushAcks(rstp);
+		
 		rstp->recvBase = recvBase;
+		if (rstp->streamTail == tail && !finReceived) continue;
+		
+		printf("There are now %llu bytes of in-order data waiting\n",
+		       rstp->streamTail - rstp->streamHead);
 	}
 	
 	return NULL;
 }
 
-// Check if the checksum is correct
-static int checksumIsCorrect(Segment s) {
-	return (getChecksum(s) == calcChecksum(s));
+// Check if the checksum is correct. The segment must also use the
+// checksum type that was agreed on, otherwise a bit error in its
+// flags could have it checked with the weaker parity bit.
+static int checksumIsCorrect(ReceiverSTP rstp, Segment s) {
+	return (hasFlag(s, CRC32C) == rstp->checksumType &&
+	        getChecksum(s) == calcChecksum(s));
 }
 
-// Check if a duplicate segment has been received.
-static int dupSegmentReceived(int nSegments, Segment buffer[],
-                              int recvBase, Segment s) {
-    int seqNo = getSeqNo(s);
+// ACKs everything before ackNo in response to the segment s (or to
+// the first segment whose ACK was held back, which this ACK covers as
+// well). s is NULL for a window update. If timestamps were agreed on,
+// the ACK echoes the timestamp of the earliest segment it is the
+// first to ACK, as in RFC 7323. The ACK advertises as much of the
+// window as the stream has room for. The ACK isn't sent until the
+// batch it belongs to is flushed.
+static void sendAck(ReceiverSTP rstp, uint ackNo, Segment s, Event e) {
+	if (rstp->delayed != NULL) {
+		s = rstp->delayed;
+	}
+	uint window = getStreamSpace(rstp);
+	if (window > rstp->windowSize) window = rstp->windowSize;
+	rstp->lastWindow = window;
+	Segment ack = newPooledSegment(rstp->ackPool, 1, ackNo, window, 0,
+	                               ACK | rstp->checksumType, NULL);
+	setConnectionId(ack, rstp->connId);
+	if (rstp->timestamps) {
+		// Only a segment that starts at or before the last ACK no.
+		// can be the earliest one that this ACK covers. Segments
+		// after it (ones that were held back, or out of order) would
+		// leave the time the earliest one waited out of the RTT.
+		if (s != NULL && (int)(getSeqNo(s) - rstp->lastAckNo) <= 0 &&
+		    (rstp->tsRecent == NO_TIMESTAMP ||
+		     (int)(getTsVal(s) - rstp->tsRecent) > 0)) {
+			rstp->tsRecent = getTsVal(s);
+		}
+		setTsEcr(ack, rstp->tsRecent);
+	}
+	rstp->lastAckNo = ackNo;
+	logEvent(rstp->rlogger, e, ack);
+	
+	if (rstp->nAcks == BATCH_SIZE) {
+		flushAcks(rstp);
+	}
+	rstp->acks[rstp->nAcks++] = ack;
+	
+	freeSegment(rstp->delayed);
+	rstp->delayed = NULL;
+	rstp->nDelayed = 0;
+}
+
+// Sends all of the ACKs that are waiting in one go
+static void flushAcks(ReceiverSTP rstp) {
+	replySocketBatch(rstp->rsock, rstp->acks, rstp->nAcks);
+	for (int i = 0; i < rstp->nAcks; i++) {
+		freeSegment(rstp->acks[i]);
+	}
+	rstp->nAcks = 0;
+}
+
+// Holds back the ACK for an in-order segment, unless it is the
+// ackEvery'th one to be held back. Returns 1 if it was held back.
+static int delayAck(ReceiverSTP rstp, Segment s) {
+	if (rstp->ackEvery <= 1) return 0;
+	
+	if (rstp->delayed == NULL) {
+		rstp->delayed = holdSegment(s);
+		rstp->ackDue = getTimeMs() + rstp->ackDelay;
+	}
+	if (++rstp->nDelayed == rstp->ackEvery) return 0;
+	
+	rstp->numAcksSaved++;
+	return 1;
+}
+
+// Waits for segments like leaveQueueBatch, but only until the held
+// back ACK is due, or until the application makes room in the stream
+// if we need it to. Returns 0 if either happens first.
+static int waitForSegments(ReceiverSTP rstp, uint recvBase, void *batch[]) {
+	int wantsRoom = needsRoom(rstp, recvBase);
+	while (1) {
+		int n = tryLeaveQueueBatch(rstp->rqueue, batch, BATCH_SIZE);
+		if (n > 0) return n;
+		
+		long long timeout = -1;
+		if (rstp->delayed != NULL) {
+			timeout = rstp->ackDue - getTimeMs();
+			if (timeout <= 0) return 0;
+		}
+		
+		// Same handshake as the queue: ask to be woken, then check
+		// again in case the application made room before it saw us
+		if (wantsRoom) {
+			__atomic_store_n(&(rstp->wantsRoom), 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (roomWasMade(rstp, recvBase)) {
+				__atomic_store_n(&(rstp->wantsRoom), 0, __ATOMIC_RELAXED);
+				return 0;
+			}
+		}
+		
+		int fd = prepareToWait(rstp->rqueue);
+		if (fd < 0) continue;
+		
+		struct pollfd pfds[2] = {
+			{ .fd = fd, .events = POLLIN },
+			{ .fd = rstp->roomFd, .events = POLLIN }
+		};
+		int ready;
+		pthread_cleanup_push(stopWaiting, rstp->rqueue);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ready = poll(pfds, 2, timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_cleanup_pop(1);
+		
+		uint64_t count;
+		if (ready > 0 && (pfds[0].revents & POLLIN) &&
+				read(fd, &count, sizeof(count)) < 0) {
+			errx(EXIT_FAILURE, "Failed to read from the queue");
+		}
+		if (ready > 0 && (pfds[1].revents & POLLIN)) {
+			if (read(rstp->roomFd, &count, sizeof(count)) < 0) {
+				errx(EXIT_FAILURE, "Failed to read the room eventfd");
+			}
+			return 0;
+		}
+	}
+}
+
+// Returns 1 if we need to hear when the application makes room: the
+// last ACK advertised less than the whole window, or the next
+// in-order segment is stuck in the ring
+static int needsRoom(ReceiverSTP rstp, uint recvBase) {
+	return (rstp->lastWindow < rstp->windowSize ||
+	        nextInRing(rstp, recvBase) != NULL);
+}
+
+// Returns 1 if there is now room for the segment stuck in the ring,
+// or for a window update
+static int roomWasMade(ReceiverSTP rstp, uint recvBase) {
+	Segment s = nextInRing(rstp, recvBase);
+	return ((s != NULL && getDataLength(s) <= getStreamSpace(rstp)) ||
+	        windowHasOpened(rstp));
+}
+
+// Returns 1 if the window has opened far enough since the last ACK to
+// be worth a window update: by an MSS, or all the way
+static int windowHasOpened(ReceiverSTP rstp) {
+	uint window = getStreamSpace(rstp);
+	if (window > rstp->windowSize) window = rstp->windowSize;
+	return (window > rstp->lastWindow &&
+	        (window - rstp->lastWindow >= rstp->mss ||
+	         window == rstp->windowSize));
+}
+
+static void stopWaiting(void *arg) {
+	finishWaiting((Queue)arg);
+}
+
+static long long getTimeMs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Check if a duplicate segment has been received. Anything after
+// recvBase can only be a duplicate of what is already in its slot.
+static int dupSegmentReceived(ReceiverSTP rstp, uint recvBase, Segment s) {
+	uint seqNo = getSeqNo(s);
 	if (seqNo < recvBase) {
 		return 1;
 	}
-	for (int i = 0; i < nSegments; i++) {
-		if (seqNo == getSeqNo(buffer[i])) {
-			return 1;
-		}
+	if (rstp->sinkFd >= 0) {
+		return (inRangeSet(rstp->written, seqNo) ||
+		        (rstp->fin != NULL && seqNo == getSeqNo(rstp->fin)));
+	}
+	if (seqNo - recvBase >= rstp->windowSize) {
+		return 0;
 	}
-	return 0;
+	Segment held = rstp->ring[ringSlot(rstp, seqNo)];
+	return (held != NULL && getSeqNo(held) == seqNo);
+}
+
+// Returns the slot in the ring for the segment starting at seqNo
+static uint ringSlot(ReceiverSTP rstp, uint seqNo) {
+	return ((seqNo - 1) / rstp->mss) % rstp->nSlots;
 }
 
-// Inserts a segment into the buffer in order with
-// insertion sort
-static void insertInOrder(int nSegments, Segment buffer[], Segment s) {
-	int seqNo = getSeqNo(s);
-	int i;
-	for (i = nSegments; i > 0 && getSeqNo(buffer[i - 1]) > seqNo; i--) {
-		buffer[i] = buffer[i - 1];
+// Puts the segment in its slot in the ring, which keeps a reference of
+// its own. Returns 0 if another segment has the slot already, which
+// can only happen if the sender cut a segment short part way through.
+static int putInRing(ReceiverSTP rstp, Segment s) {
+	uint slot = ringSlot(rstp, getSeqNo(s));
+	if (rstp->ring[slot] != NULL) {
+		return 0;
 	}
-	buffer[i] = s;
+	rstp->ring[slot] = holdSegment(s);
+	return 1;
 }
 
-// Gets the number of inorder segments, so we know
-// how many segments worth of data we can send up
-// to the application layer
-static int getNumInOrderSegments(int nSegments, Segment buffer[]) {
-	int nInOrderSegments = 1;
-	for (int i = 1; i < nSegments; i++) {
-		if (getSeqNo(buffer[i - 1]) + getDataLength(buffer[i - 1]) !=
-				getSeqNo(buffer[i])) {
+// Returns the segment in the ring that starts at recvBase, if there
+// is one (without another reference to it)
+static Segment nextInRing(ReceiverSTP rstp, uint recvBase) {
+	if (rstp->ring == NULL) {
+		return NULL;
+	}
+	Segment s = rstp->ring[ringSlot(rstp, recvBase)];
+	return (s != NULL && getSeqNo(s) == recvBase ? s : NULL);
+}
+
+// Moves the segments that are now in order from the ring to the
+// stream, starting from recvBase, for as long as there is room.
+// Returns the new recvBase.
+static uint drainInOrder(ReceiverSTP rstp, uint recvBase, int *finReceived) {
+	if (rstp->sinkFd >= 0) {
+		return drainWritten(rstp, recvBase, finReceived);
+	}
+	
+	Segment s;
+	while ((s = nextInRing(rstp, recvBase)) != NULL) {
+		uint length = getDataLength(s);
+		if (length > getStreamSpace(rstp) ||
+				!tryEnterQueue(rstp->stream, s)) {
 			break;
 		}
-		nInOrderSegments++;
+		rstp->ring[ringSlot(rstp, recvBase)] = NULL;
+		__atomic_store_n(&(rstp->streamTail), rstp->streamTail + length,
+		                 __ATOMIC_RELAXED);
+		
+		recvBase += length;
+		if (hasFlag(s, FIN)) {
+			recvBase++;
+			*finReceived = 1;
+		}
 	}
-	return nInOrderSegments;
+	return recvBase;
 }
 
-// Gets the total number of bytes of data in the
-// first nInOrderSegments segments in the buffer.
-// These segments must be in order when the
-// function is called.
-static int getInOrderDataLength(int nInOrderSegments, Segment buffer[]) {
-	int dataLength = 0;
-	for (int i = 0; i < nInOrderSegments; i++) {
-		dataLength += getDataLength(buffer[i]);
+// Writes the segment's data to where it goes in the file, and notes
+// that it is there. The FIN is kept until it is in order.
+static void writeToSink(ReceiverSTP rstp, Segment s) {
+	if (hasFlag(s, FIN)) {
+		rstp->fin = holdSegment(s);
+	}
+	uint length = getDataLength(s);
+	if (length == 0) return;
+	
+	off_t offset = rstp->offset + getSeqNo(s) - 1;
+	if (pwrite(rstp->sinkFd, getDataPortion(s), length, offset) != length) {
+		errx(EXIT_FAILURE, "Write failed (writeToSink)");
 	}
-	return dataLength;
+	addRange(rstp->written, getSeqNo(s), getSeqNo(s) + length);
 }
 
-static void copyToDataBuffer(ReceiverSTP rstp, int nInOrderSegments,
-                             Segment buffer[]) {
-	int cumulativeLen = 0;
-	for (int i = 0; i < nInOrderSegments; i++) {
-		memcpy(rstp->dataBuffer + cumulativeLen, getDataPortion(buffer[i]),
-		       getDataLength(buffer[i]));
-		cumulativeLen += getDataLength(buffer[i]);
+// Moves recvBase past everything that has been written after it, and
+// past the FIN if it is next, in which case the FIN goes on to the
+// stream to tell the application
+static uint drainWritten(ReceiverSTP rstp, uint recvBase, int *finReceived) {
+	recvBase = takeRangeFrom(rstp->written, recvBase);
+	if (rstp->fin != NULL && getSeqNo(rstp->fin) == recvBase) {
+		enterQueue(rstp->stream, rstp->fin);
+		rstp->fin = NULL;
+		recvBase++;
+		*finReceived = 1;
 	}
+	return recvBase;
+}
+
+// Only handleData calls this, so the space can only grow under it
+static uint getStreamSpace(ReceiverSTP rstp) {
+	unsigned long long head = __atomic_load_n(&(rstp->streamHead),
+	                                          __ATOMIC_ACQUIRE);
+	return rstp->streamCapacity - (rstp->streamTail - head);
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Establish the connection on the receiver side
 // through the three-way handshake.
 void establishSTP(ReceiverSTP rstp) {
-	rstp->rlogger = newReceiverLogger("Receiver_log.txt");
+	rstp->rlogger = newReceiverLogger(rstp->logName);
 
 	Segment s;
 	
-	// Receiving a SYN
-	s = malloc(20);
-	receiveSocket(rstp->rsock, 20, s);
+	// Receiving a SYN. We support every checksum type and
+	// timestamps, so we agree to whatever the sender asks for.
+	s = receiveControl(rstp, sizeof(SynOptions));
 	logEvent(rstp->rlogger, RECEIVED, s);
 	rstp->windowSize = getWindowSize(s);
+	rstp->checksumType = hasFlag(s, CRC32C);
+	rstp->timestamps = hasFlag(s, TIMESTAMPS);
+	rstp->connId = getConnectionId(s);
+	rstp->mss = rstp->windowSize;
+	if (getDataLength(s) >= sizeof(SynOptions)) {
+		SynOptions *options = (SynOptions *)getDataPortion(s);
+		rstp->mss = options->mss;
+		rstp->offset = options->offset;
+		
+		// We agree to delayed ACKs, up to our limits
+		rstp->ackEvery = options->ackEvery;
+		if (rstp->ackEvery < 1) rstp->ackEvery = 1;
+		if (rstp->ackEvery > MAX_ACK_EVERY) rstp->ackEvery = MAX_ACK_EVERY;
+		rstp->ackDelay = options->ackDelay;
+		if (rstp->ackDelay > MAX_ACK_DELAY) rstp->ackDelay = MAX_ACK_DELAY;
+	}
 	freeSegment(s);
 	
+	if (rstp->windowSize == 0) rstp->windowSize = 1;
+	rstp->lastWindow = rstp->windowSize;  // As the SYN/ACK advertises
+	if (rstp->sinkFd >= 0) {
+		rstp->written = newRangeSet();
+	} else {
+		rstp->nSlots = (rstp->windowSize + rstp->mss - 1) / rstp->mss;
+		rstp->ring = calloc(rstp->nSlots, sizeof(Segment));
+	}
+	rstp->streamCapacity = STREAM_WINDOWS *
+		(rstp->windowSize > rstp->mss ? rstp->windowSize : rstp->mss);
+	rstp->stream = newSpscQueue(2 * (rstp->streamCapacity / rstp->mss + 1));
+	if (rstp->ring == NULL && rstp->written == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (establishSTP)");
+	}
+	rstp->ackPool = newSegmentPool(0, SLOTS_PER_SLAB);
+	__atomic_store_n(&(rstp->dataPool),
+	                 newSegmentPool(rstp->mss, SLOTS_PER_SLAB),
+	                 __ATOMIC_RELEASE);
+	
 	// Sending a SYN/ACK
-	s = newSegment(0, 1, rstp->windowSize,
-	               0, SYN | ACK, NULL);
+	s = newSegment(0, 1, rstp->windowSize, 0,
+	               SYN | ACK | rstp->checksumType | rstp->timestamps, NULL);
+	
 	logEvent(rstp->rlogger, SENT, s);
-	replySocket(rstp->rsock, 0, s);
+	replyControl(rstp, s);
 	freeSegment(s);
 	
 	// Receiving an ACK
-	s = malloc(20);
-	receiveSocket(rstp->rsock, 20, s);
+	s = receiveControl(rstp, 0);
 	logEvent(rstp->rlogger, RECEIVED, s);
 	freeSegment(s);
 	
+	if (rstp->attached) {
+		pthread_create(&(rstp->handleDataThread), NULL, handleData, rstp);
+		return;
+	}
+	
+	if (rstp->useUring && !enableUring(rstp->rsock, rstp->ackPool,
+	                                   rstp->mss + getHeaderSize())) {
+		warnx("io_uring isn't available, using blocking sockets");
+		rstp->useUring = 0;
+		enableReceiveOffload(rstp->rsock);
+	}
+	
 	pthread_create(&(rstp->handleDataThread), NULL, handleData, rstp);
 	pthread_create(&(rstp->receiveDataThread), NULL, receiveData, rstp);
 }
@@ -307,9 +869,21 @@ void establishSTP(ReceiverSTP rstp) {
 // the receiver is waiting for the sender to
 // initiate the close.
 void teardownSTP(ReceiverSTP rstp) {
-	pthread_cancel(rstp->receiveDataThread);
+	if (!rstp->attached) {
+		pthread_cancel(rstp->receiveDataThread);
+	}
 	pthread_cancel(rstp->handleDataThread);
 	
+	// The rest of the teardown uses blocking calls again. An attached
+	// connection takes the rest of its segments off the queue instead.
+	if (!rstp->attached) {
+		pthread_join(rstp->receiveDataThread, NULL);
+	}
+	pthread_join(rstp->handleDataThread, NULL);
+	if (rstp->useUring) {
+		disableUring(rstp->rsock);
+	}
+	
 	Segment s;
 	
 	// Waste time
@@ -321,18 +895,44 @@ void teardownSTP(ReceiverSTP rstp) {
 	// Sending a FIN
 	s = newSegment(1, rstp->recvBase,
 	               rstp->windowSize, 0,
-	               FIN, NULL);
+	               FIN | rstp->checksumType, NULL);
 	logEvent(rstp->rlogger, SENT, s);
-	replySocket(rstp->rsock, 0, s);
+	replyControl(rstp, s);
 	freeSegment(s);
 	
-	// Receiving an ACK
-	s = malloc(20);
-	receiveSocket(rstp->rsock, 20, s);
+	// Receiving an ACK (an attached connection skips over any
+	// retransmissions still waiting for it)
+	s = receiveControl(rstp, 0);
+	while (rstp->attached && !hasFlag(s, ACK)) {
+		freeSegment(s);
+		s = receiveControl(rstp, 0);
+	}
 	logEvent(rstp->rlogger, RECEIVED, s);
 	freeSegment(s);
 	
+	logAcksSaved(rstp->rlogger, rstp->numAcksSaved);
 	logSummary(rstp->rlogger);
-	closeSocket(rstp->rsock);
+	showPool(rstp->dataPool, "data segments");
+	showPool(rstp->ackPool, "ACKs");
+	if (!rstp->attached) {
+		closeSocket(rstp->rsock);
+	}
+}
+
+// Receives a segment of the handshake or teardown, which has up to
+// maxDataLength bytes of data
+static Segment receiveControl(ReceiverSTP rstp, uint maxDataLength) {
+	if (rstp->attached) {
+		return leaveQueue(rstp->rqueue);
+	}
+	
+	Segment s = newEmptySegment(NULL, maxDataLength);
+	receiveSocket(rstp->rsock, getHeaderSize() + maxDataLength, s);
+	return s;
+}
+
+static void replyControl(ReceiverSTP rstp, Segment s) {
+	setConnectionId(s, rstp->connId);
+	replySocket(rstp->rsock, 0, s);
 }
 
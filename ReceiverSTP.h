@@ -4,15 +4,37 @@
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for COMP3331 18s2 Assignment
 
+#ifndef RECEIVER_STP
+#define RECEIVER_STP
+
+#include <sys/uio.h>
+
 #include "ReceiverSocket.h"
 
 typedef struct receiverSTP *ReceiverSTP;
 
 ReceiverSTP newSTP(int recvPort);
 
-int pullDataFromSTP(ReceiverSTP rstp, char **data);
+ReceiverSTP newAttachedSTP(ReceiverSocket rsock, char *logName);
+
+int deliverToSTP(ReceiverSTP rstp, Segment s, int size);
+
+void freeSTP(ReceiverSTP rstp);
+
+void requestUring(ReceiverSTP rstp);
+
+void setFileSink(ReceiverSTP rstp, int fd);
+
+void setLogName(ReceiverSTP rstp, char *logName);
+
+unsigned long long getRangeOffset(ReceiverSTP rstp);
+
+int borrowDataFromSTP(ReceiverSTP rstp, struct iovec iov[], int maxIov);
+
+void releaseDataToSTP(ReceiverSTP rstp);
 
 void establishSTP(ReceiverSTP rstp);
 
 void teardownSTP(ReceiverSTP rstp);
 
+#endif
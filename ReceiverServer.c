@@ -0,0 +1,287 @@
+// ReceiverServer.c
+// Implementation of the ReceiverServer ADT
+// The port is split over one or more workers, each with a socket of
+// its own bound with SO_REUSEPORT and a thread pinned to a core. The
+// kernel sends all of a connection's datagrams to the same socket, so
+// each worker owns a disjoint set of connections.
+// A worker's thread receives every datagram on its socket and looks up
+// its connection in the worker's hash table, keyed by the sender's
+// address and the connection ID. A SYN that matches no connection
+// starts a new one. Each connection is an attached ReceiverSTP with a
+// thread of its own (which stays on the worker's core), that does the
+// handshake, runs the handler and tears the connection down, and then
+// hands it back to be removed from the table and freed.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#define _GNU_SOURCE  // For pthread_setaffinity_np
+
+#include <err.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Queue.h"
+#include "ReceiverServer.h"
+#include "ReceiverSocket.h"
+#include "ReceiverSTP.h"
+#include "Segment.h"
+
+#define NUM_BUCKETS      64
+#define BATCH_SIZE       16
+#define MAX_DATAGRAM     65507  // Largest UDP payload over IPv4
+#define QUEUE_CAPACITY   1024
+#define LOG_NAME_LENGTH  64
+
+typedef struct connection *Connection;
+typedef struct worker *Worker;
+
+struct connection {
+	struct sockaddr_in peer;
+	uint               connId;
+	uint               number;
+	ReceiverSTP        rstp;
+	Worker             worker;
+	pthread_t          thread;
+	Connection         next;  // In the same bucket
+};
+
+struct worker {
+	ReceiverServer     server;
+	ReceiverSocket     rsock;
+	int                cpu;
+	Connection         buckets[NUM_BUCKETS];
+	sem_t              lock;      // Only contended when removing
+	pthread_t          thread;
+};
+
+struct receiverServer {
+	Worker             workers;
+	uint               nWorkers;
+	uint               numAccepted;
+	Queue              finished;  // Connections that have been torn down
+	
+	ConnectionHandler  handler;
+	void              *handlerArg;
+};
+
+static void *dispatchSegments(void *arg);
+static void freeBatch(void *arg);
+static Connection findConnection(Worker worker, struct sockaddr_in *peer,
+                                 uint connId);
+static Connection acceptConnection(Worker worker, struct sockaddr_in *peer,
+                                   uint connId);
+static void removeConnection(Worker worker, Connection c);
+static void *runConnection(void *arg);
+static uint hashKey(struct sockaddr_in *peer, uint connId);
+
+// Worker i is pinned to core i (wrapping around if there are more
+// workers than cores)
+ReceiverServer newReceiverServer(int recvPort, uint nWorkers, int steer) {
+	ReceiverServer server = calloc(1, sizeof(struct receiverServer));
+	if (server == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newReceiverServer)");
+	}
+	if (nWorkers == 0) nWorkers = 1;
+	server->workers = calloc(nWorkers, sizeof(struct worker));
+	if (server->workers == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newReceiverServer)");
+	}
+	server->nWorkers = nWorkers;
+	server->finished = newQueue(QUEUE_CAPACITY);
+	
+	long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (uint i = 0; i < nWorkers; i++) {
+		Worker worker = &(server->workers[i]);
+		worker->server = server;
+		worker->rsock = newSharedSocket(recvPort);
+		enableReceiveOffload(worker->rsock);
+		worker->cpu = (nCpus > 0 ? i % nCpus : -1);
+		sem_init(&(worker->lock), 0, 1);
+	}
+	
+	if (steer && !steerByConnectionId(server->workers[0].rsock, nWorkers)) {
+		warnx("couldn't steer connections with BPF, "
+		      "leaving it to the kernel's hashing");
+	}
+	return server;
+}
+
+void serveConnections(ReceiverServer server, uint maxConnections,
+                      ConnectionHandler handler, void *arg) {
+	server->handler = handler;
+	server->handlerArg = arg;
+	for (uint i = 0; i < server->nWorkers; i++) {
+		Worker worker = &(server->workers[i]);
+		pthread_create(&(worker->thread), NULL, dispatchSegments, worker);
+	}
+	
+	// Clean up after each connection as it finishes
+	uint numFinished = 0;
+	while (maxConnections == 0 || numFinished < maxConnections) {
+		Connection c = leaveQueue(server->finished);
+		pthread_join(c->thread, NULL);
+		
+		sem_wait(&(c->worker->lock));
+		removeConnection(c->worker, c);
+		sem_post(&(c->worker->lock));
+		
+		freeSTP(c->rstp);
+		free(c);
+		numFinished++;
+	}
+	
+	for (uint i = 0; i < server->nWorkers; i++) {
+		pthread_cancel(server->workers[i].thread);
+		pthread_join(server->workers[i].thread, NULL);
+	}
+}
+
+// Connections that are still open are left alone
+void freeReceiverServer(ReceiverServer server) {
+	for (uint i = 0; i < server->nWorkers; i++) {
+		closeSocket(server->workers[i].rsock);
+		sem_destroy(&(server->workers[i].lock));
+	}
+	free(server->workers);
+	freeQueue(server->finished);
+	free(server);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// Thread for a worker, which passes segments to their connections
+// It can only be cancelled while it waits for datagrams, so it never
+// stops with the table locked. A connection that has fallen too far
+// behind loses the segment, as it would have if the socket's buffer
+// had overflowed.
+static void *dispatchSegments(void *arg) {
+	Worker worker = (Worker)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	
+	// Threads started from here (the connections') stay on this core
+	if (worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	
+	Segment batch[BATCH_SIZE];
+	int sizes[BATCH_SIZE];
+	struct sockaddr_in peers[BATCH_SIZE];
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		batch[i] = newEmptySegment(NULL, MAX_DATAGRAM - getHeaderSize());
+	}
+	pthread_cleanup_push(freeBatch, batch);
+	
+	while (1) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int n = receiveSocketBatchFrom(worker->rsock, MAX_DATAGRAM, batch,
+		                               sizes, peers, BATCH_SIZE);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		
+		sem_wait(&(worker->lock));
+		for (int i = 0; i < n; i++) {
+			Segment s = batch[i];
+			if (sizes[i] < getHeaderSize()) continue;
+			
+			uint connId = getConnectionId(s);
+			Connection c = findConnection(worker, &peers[i], connId);
+			if (c == NULL && hasFlag(s, SYN) && !hasFlag(s, ACK)) {
+				c = acceptConnection(worker, &peers[i], connId);
+			}
+			if (c != NULL) {
+				deliverToSTP(c->rstp, s, sizes[i]);
+			}
+		}
+		sem_post(&(worker->lock));
+	}
+	
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void freeBatch(void *arg) {
+	Segment *batch = (Segment *)arg;
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		freeSegment(batch[i]);
+	}
+}
+
+// Must be called with the lock held
+static Connection findConnection(Worker worker, struct sockaddr_in *peer,
+                                 uint connId) {
+	Connection c = worker->buckets[hashKey(peer, connId)];
+	while (c != NULL) {
+		if (c->connId == connId &&
+				c->peer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+				c->peer.sin_port == peer->sin_port) {
+			return c;
+		}
+		c = c->next;
+	}
+	return NULL;
+}
+
+// Adds a connection to the table and starts its thread. Must be
+// called with the lock held.
+static Connection acceptConnection(Worker worker, struct sockaddr_in *peer,
+                                   uint connId) {
+	ReceiverServer server = worker->server;
+	Connection c = malloc(sizeof(struct connection));
+	if (c == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (acceptConnection)");
+	}
+	c->peer = *peer;
+	c->connId = connId;
+	c->number = __atomic_add_fetch(&(server->numAccepted), 1,
+	                               __ATOMIC_RELAXED);
+	c->worker = worker;
+	
+	char logName[LOG_NAME_LENGTH];
+	snprintf(logName, LOG_NAME_LENGTH, "Receiver_log.%u.txt", c->number);
+	c->rstp = newAttachedSTP(newPeerSocket(worker->rsock, peer), logName);
+	
+	uint bucket = hashKey(peer, connId);
+	c->next = worker->buckets[bucket];
+	worker->buckets[bucket] = c;
+	
+	pthread_create(&(c->thread), NULL, runConnection, c);
+	return c;
+}
+
+// Must be called with the lock held
+static void removeConnection(Worker worker, Connection c) {
+	Connection *link = &(worker->buckets[hashKey(&(c->peer), c->connId)]);
+	while (*link != c) {
+		link = &((*link)->next);
+	}
+	*link = c->next;
+}
+
+// Thread for one connection
+static void *runConnection(void *arg) {
+	Connection c = (Connection)arg;
+	ReceiverServer server = c->worker->server;
+	
+	establishSTP(c->rstp);
+	printf("Connection %u established.\n", c->number);
+	server->handler(c->rstp, c->number, server->handlerArg);
+	teardownSTP(c->rstp);
+	printf("Connection %u terminated.\n", c->number);
+	
+	enterQueue(server->finished, c);
+	return NULL;
+}
+
+static uint hashKey(struct sockaddr_in *peer, uint connId) {
+	uint h = peer->sin_addr.s_addr * 2654435761U;
+	h ^= peer->sin_port * 40503U;
+	h ^= connId * 2246822519U;
+	return (h ^ (h >> 16)) % NUM_BUCKETS;
+}
@@ -0,0 +1,36 @@
+// ReceiverServer.h
+// Header file for the ReceiverServer ADT
+// A server accepts any number of STP connections on one port at once.
+// Segments are passed to their connection by the address they came
+// from and the connection ID in their header. The connections can be
+// sharded over several workers, each on its own core.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef RECEIVER_SERVER_H
+#define RECEIVER_SERVER_H
+
+#include "ReceiverSTP.h"
+
+typedef struct receiverServer *ReceiverServer;
+
+typedef unsigned int uint;
+
+// Called on a thread of its own for each connection, once it has been
+// established, to pull all of its data. Connections are numbered from
+// 1 in the order they arrive.
+typedef void (*ConnectionHandler)(ReceiverSTP rstp, uint number, void *arg);
+
+// Splits the port over nWorkers workers. If steer is set, connections
+// are spread over them by connection ID with a BPF program, rather
+// than by the kernel hashing their addresses.
+ReceiverServer newReceiverServer(int recvPort, uint nWorkers, int steer);
+
+// Serves connections until maxConnections of them have been torn down
+// (forever if it is 0). Connection n is logged to Receiver_log.n.txt.
+void serveConnections(ReceiverServer server, uint maxConnections,
+                      ConnectionHandler handler, void *arg);
+
+void freeReceiverServer(ReceiverServer server);
+
+#endif
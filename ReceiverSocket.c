@@ -3,23 +3,120 @@
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
+#define _GNU_SOURCE  // For sendmmsg and recvmmsg
+
 #include <arpa/inet.h>
 #include <err.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "ReceiverSocket.h"
+#include "Uring.h"
+
+#define MAX_BATCH 64
+
+// With receive offload, the kernel can hand over up to 64KB of
+// segments as one datagram
+#define GRO_BATCH        8
+#define GRO_BUFFER_SIZE  65536
+
+// io_uring
+#define URING_ENTRIES    256
+#define MAX_REGISTERED   64   // Slabs that can be registered buffers
+#define DATA_BUFFERS     512  // Provided buffers for data segments
+#define DATA_GROUP       0
+
+// Completions that aren't for a reply carry one of these instead of
+// the segment that was sent
+#define RECV_TAG   1
+#define CANCEL_TAG 2
+#define NUM_TAGS   3
+
+// A coalesced datagram that hasn't been split up completely yet
+struct groDatagram {
+	char              *data;
+	int                length;
+	int                segmentSize;
+	int                offset;  // Where the next segment starts
+	struct sockaddr_in addr;
+};
 
 struct receiverSocket {
 	int                sockfd;
+	int                isPeer;  // Shares another socket's sockfd
 	struct sockaddr_in serveraddr;
 	struct sockaddr_in clientaddr;
 	socklen_t          slen;
+	
+	int                gro;  // 1 if the kernel coalesces datagrams
+	struct groDatagram groDatagrams[GRO_BATCH];
+	int                nGroDatagrams;
+	int                nextGroDatagram;
+	
+	// Only used with io_uring
+	Uring              ring;       // NULL if not using io_uring
+	Pool               pool;       // Its slabs are the registered buffers
+	int                bufferSize;
+	int                receiving;  // A multishot receive is armed
+	int                closing;    // Don't arm the receive again
+	uint               repliesInFlight;
+	sem_t              lock;       // Replies are sent from another thread
 };
 
+static ReceiverSocket createSocket(int recvPort, int reusePort);
+static void receiveCoalesced(ReceiverSocket rsock);
+static int receiveThroughUring(ReceiverSocket rsock, int length,
+                               Segment segments[], int sizes[], int n);
+static void replyThroughUring(ReceiverSocket rsock, Segment segments[],
+                              int n);
+static int reapCompletions(ReceiverSocket rsock, int length,
+                           Segment segments[], int sizes[], int n);
+static void armReceive(ReceiverSocket rsock);
+static void registerSlab(void *arg, void *slab, unsigned long size);
+
 ReceiverSocket newSocket(int recvPort) {
+	return createSocket(recvPort, 0);
+}
+
+// The kernel spreads datagrams over every socket bound to the port
+// with SO_REUSEPORT by hashing their addresses and ports, so all of a
+// sender's datagrams go to the same socket
+ReceiverSocket newSharedSocket(int recvPort) {
+	return createSocket(recvPort, 1);
+}
+
+// Attaches a classic BPF program to the group of shared sockets on
+// the port, which picks the socket for each datagram from its
+// connection ID instead (the ID read as a big-endian word, mod
+// nSockets, indexing the sockets in the order they were bound). This
+// spreads many connections from one address evenly as well.
+// Returns 0 if it isn't supported.
+int steerByConnectionId(ReceiverSocket rsock, uint nSockets) {
+	struct sock_filter code[] = {
+		// The program sees the datagram from the UDP payload onwards
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, getConnectionIdOffset()),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nSockets),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	return (setsockopt(rsock->sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	                   &prog, sizeof(prog)) == 0);
+}
+
+static ReceiverSocket createSocket(int recvPort, int reusePort) {
 	ReceiverSocket rsock = calloc(1, sizeof(struct receiverSocket));
 	if (rsock == NULL) {
 		errx(EXIT_FAILURE, "Insufficient memory!");
@@ -30,6 +127,12 @@ ReceiverSocket newSocket(int recvPort) {
 		errx(EXIT_FAILURE, "Socket creation failed");
 	}
 	
+	int on = 1;
+	if (reusePort && setsockopt(rsock->sockfd, SOL_SOCKET, SO_REUSEPORT,
+			&on, sizeof(on)) < 0) {
+		errx(EXIT_FAILURE, "Couldn't share the port (SO_REUSEPORT)");
+	}
+	
 	// Filling in server information...
 	(rsock->serveraddr).sin_family = AF_INET;
 	(rsock->serveraddr).sin_addr.s_addr = INADDR_ANY;
@@ -45,6 +148,19 @@ ReceiverSocket newSocket(int recvPort) {
 	return rsock;
 }
 
+ReceiverSocket newPeerSocket(ReceiverSocket rsock, struct sockaddr_in *peer) {
+	ReceiverSocket new = calloc(1, sizeof(struct receiverSocket));
+	if (new == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newPeerSocket)");
+	}
+	new->sockfd = rsock->sockfd;
+	new->isPeer = 1;
+	new->serveraddr = rsock->serveraddr;
+	new->clientaddr = *peer;
+	new->slen = sizeof(new->clientaddr);
+	return new;
+}
+
 int receiveSocket(ReceiverSocket rsock, int length, Segment s) {
 	int recv_len;
 	if ((recv_len = recvfrom(rsock->sockfd, s, length, 0,
@@ -64,7 +180,372 @@ void replySocket(ReceiverSocket rsock, int length, Segment s) {
 	}
 }
 
+// Lets the kernel coalesce runs of same-sized datagrams (GRO), which
+// receiveSocketBatch splits back up. Returns 0 if it isn't supported.
+int enableReceiveOffload(ReceiverSocket rsock) {
+	int on = 1;
+	if (setsockopt(rsock->sockfd, IPPROTO_UDP, UDP_GRO,
+			&on, sizeof(on)) < 0) {
+		return 0;
+	}
+	
+	char *buffers = malloc(GRO_BATCH * GRO_BUFFER_SIZE);
+	if (buffers == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (enableReceiveOffload)");
+	}
+	for (int i = 0; i < GRO_BATCH; i++) {
+		rsock->groDatagrams[i].data = buffers + i * GRO_BUFFER_SIZE;
+	}
+	rsock->nGroDatagrams = 0;
+	rsock->nextGroDatagram = 0;
+	rsock->gro = 1;
+	return 1;
+}
+
+void disableReceiveOffload(ReceiverSocket rsock) {
+	if (!rsock->gro) return;
+	
+	int off = 0;
+	setsockopt(rsock->sockfd, IPPROTO_UDP, UDP_GRO, &off, sizeof(off));
+	free(rsock->groDatagrams[0].data);
+	rsock->gro = 0;
+}
+
+// Replies go to whoever sent the last datagram, as with receiveSocket.
+// With receive offload, segments are copied out of the coalesced
+// datagrams, and whatever doesn't fit is kept for the next call.
+int receiveSocketBatch(ReceiverSocket rsock, int length, Segment segments[],
+                       int sizes[], int n) {
+	if (rsock->ring != NULL) {
+		return receiveThroughUring(rsock, length, segments, sizes, n);
+	}
+	
+	struct sockaddr_in peers[MAX_BATCH];
+	if (n > MAX_BATCH) n = MAX_BATCH;
+	int received = receiveSocketBatchFrom(rsock, length, segments, sizes,
+	                                      peers, n);
+	rsock->clientaddr = peers[received - 1];
+	rsock->slen = sizeof(rsock->clientaddr);
+	return received;
+}
+
+int receiveSocketBatchFrom(ReceiverSocket rsock, int length,
+                           Segment segments[], int sizes[],
+                           struct sockaddr_in peers[], int n) {
+	if (rsock->gro) {
+		if (rsock->nextGroDatagram == rsock->nGroDatagrams) {
+			receiveCoalesced(rsock);
+		}
+		
+		int count = 0;
+		while (count < n && rsock->nextGroDatagram < rsock->nGroDatagrams) {
+			struct groDatagram *d = &(rsock->groDatagrams[rsock->nextGroDatagram]);
+			int size = d->length - d->offset;
+			if (size > d->segmentSize) size = d->segmentSize;
+			
+			// Longer datagrams are cut short, as recvfrom would
+			sizes[count] = (size < length ? size : length);
+			memcpy(segments[count], d->data + d->offset, sizes[count]);
+			peers[count] = d->addr;
+			count++;
+			
+			d->offset += size;
+			if (d->offset == d->length) {
+				rsock->nextGroDatagram++;
+			}
+		}
+		return count;
+	}
+	
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iovecs[MAX_BATCH];
+	
+	if (n > MAX_BATCH) n = MAX_BATCH;
+	memset(msgs, 0, n * sizeof(struct mmsghdr));
+	for (int i = 0; i < n; i++) {
+		iovecs[i].iov_base = segments[i];
+		iovecs[i].iov_len = length;
+		msgs[i].msg_hdr.msg_name = &peers[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	int received = recvmmsg(rsock->sockfd, msgs, n, MSG_WAITFORONE, NULL);
+	if (received < 0) {
+		errx(EXIT_FAILURE, "Failed to receive data");
+	}
+	
+	for (int i = 0; i < received; i++) {
+		sizes[i] = msgs[i].msg_len;
+	}
+	return received;
+}
+
+void replySocketBatch(ReceiverSocket rsock, Segment segments[], int n) {
+	if (rsock->ring != NULL) {
+		replyThroughUring(rsock, segments, n);
+		return;
+	}
+	
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iovecs[MAX_BATCH];
+	
+	while (n > 0) {
+		int count = (n < MAX_BATCH ? n : MAX_BATCH);
+		memset(msgs, 0, count * sizeof(struct mmsghdr));
+		for (int i = 0; i < count; i++) {
+			iovecs[i].iov_base = segments[i];
+			iovecs[i].iov_len = getHeaderSize();
+			msgs[i].msg_hdr.msg_name = &(rsock->clientaddr);
+			msgs[i].msg_hdr.msg_namelen = rsock->slen;
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		
+		// sendmmsg can stop part way, so keep going from there
+		int sent = 0;
+		while (sent < count) {
+			int r = sendmmsg(rsock->sockfd, msgs + sent, count - sent, 0);
+			if (r < 0) {
+				errx(EXIT_FAILURE, "Failed to send replies");
+			}
+			sent += r;
+		}
+		
+		segments += count;
+		n -= count;
+	}
+}
+
 void closeSocket(ReceiverSocket rsock) {
+	if (rsock->isPeer) {
+		free(rsock);
+		return;
+	}
 	close(rsock->sockfd);
 }
 
+// Blocks until at least one datagram arrives, then receives as many
+// (possibly coalesced) datagrams as are waiting, up to GRO_BATCH.
+// A datagram that wasn't coalesced has no segment size attached, so
+// it is treated as a single segment.
+static void receiveCoalesced(ReceiverSocket rsock) {
+	struct mmsghdr msgs[GRO_BATCH];
+	struct iovec iovecs[GRO_BATCH];
+	char control[GRO_BATCH][CMSG_SPACE(sizeof(int))];
+	
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < GRO_BATCH; i++) {
+		struct groDatagram *d = &(rsock->groDatagrams[i]);
+		iovecs[i].iov_base = d->data;
+		iovecs[i].iov_len = GRO_BUFFER_SIZE;
+		msgs[i].msg_hdr.msg_name = &(d->addr);
+		msgs[i].msg_hdr.msg_namelen = sizeof(d->addr);
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = control[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+	
+	int received = recvmmsg(rsock->sockfd, msgs, GRO_BATCH, MSG_WAITFORONE,
+	                        NULL);
+	if (received < 0) {
+		errx(EXIT_FAILURE, "Failed to receive data");
+	}
+	
+	for (int i = 0; i < received; i++) {
+		struct groDatagram *d = &(rsock->groDatagrams[i]);
+		d->length = msgs[i].msg_len;
+		d->segmentSize = d->length;
+		d->offset = 0;
+		
+		struct cmsghdr *cmsg;
+		for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == IPPROTO_UDP &&
+					cmsg->cmsg_type == UDP_GRO) {
+				memcpy(&(d->segmentSize), CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		
+		// Make sure splitting it up always gets somewhere
+		if (d->segmentSize <= 0) d->segmentSize = 1;
+	}
+	rsock->nGroDatagrams = received;
+	rsock->nextGroDatagram = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// io_uring
+
+// Data segments are received by one multishot receive into provided
+// buffers of bufferSize bytes, and copied out into the caller's
+// segments. Replies from the pool are sent straight out of registered
+// buffers, which needs the socket to be connected to the sender.
+int enableUring(ReceiverSocket rsock, Pool pool, int bufferSize) {
+	Uring ring = newUring(URING_ENTRIES);
+	if (ring == NULL) return 0;
+	
+	if (registerBufferTable(ring, MAX_REGISTERED) < 0 ||
+			provideBuffers(ring, DATA_GROUP, DATA_BUFFERS, bufferSize) < 0 ||
+			connect(rsock->sockfd, (struct sockaddr *)&(rsock->clientaddr),
+			        rsock->slen) < 0) {
+		freeUring(ring);
+		return 0;
+	}
+	
+	rsock->ring = ring;
+	rsock->pool = pool;
+	rsock->bufferSize = bufferSize;
+	rsock->closing = 0;
+	rsock->repliesInFlight = 0;
+	sem_init(&(rsock->lock), 0, 1);
+	setSlabHook(pool, registerSlab, rsock);
+	
+	armReceive(rsock);
+	if (submitUring(ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to submit to io_uring");
+	}
+	return 1;
+}
+
+// Must only be called once nothing else is using the socket. Cancels
+// the receive and waits for every reply to be sent.
+void disableUring(ReceiverSocket rsock) {
+	if (rsock->ring == NULL) return;
+	
+	rsock->closing = 1;
+	struct io_uring_sqe *sqe = getSqe(rsock->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = RECV_TAG;
+	sqe->user_data = CANCEL_TAG;
+	if (submitUring(rsock->ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to submit to io_uring");
+	}
+	
+	// Any segments that are still coming in are dropped
+	Segment s = newEmptySegment(NULL, rsock->bufferSize - getHeaderSize());
+	int size;
+	while (rsock->receiving || rsock->repliesInFlight > 0) {
+		waitUring(rsock->ring, 1);
+		reapCompletions(rsock, rsock->bufferSize, &s, &size, 1);
+	}
+	freeSegment(s);
+	
+	setSlabHook(rsock->pool, NULL, NULL);
+	freeUring(rsock->ring);
+	rsock->ring = NULL;
+	sem_destroy(&(rsock->lock));
+}
+
+// Waits without the lock, so that replies can be sent in the meantime
+static int receiveThroughUring(ReceiverSocket rsock, int length,
+                               Segment segments[], int sizes[], int n) {
+	int count = reapCompletions(rsock, length, segments, sizes, n);
+	while (count == 0) {
+		if (waitUring(rsock->ring, 1) < 0) {
+			errx(EXIT_FAILURE, "Failed to wait on io_uring");
+		}
+		count = reapCompletions(rsock, length, segments, sizes, n);
+	}
+	return count;
+}
+
+// The socket holds on to each reply until it has been sent
+static void replyThroughUring(ReceiverSocket rsock, Segment segments[],
+                              int n) {
+	int oldState;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+	sem_wait(&(rsock->lock));
+	for (int i = 0; i < n; i++) {
+		Segment s = holdSegment(segments[i]);
+		struct io_uring_sqe *sqe = getSqe(rsock->ring);
+		int index = findRegisteredBuffer(rsock->ring, s, getHeaderSize());
+		if (index >= 0) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = index;
+		} else {
+			sqe->opcode = IORING_OP_SEND;
+		}
+		sqe->fd = rsock->sockfd;
+		sqe->addr = (uint64_t)(uintptr_t)s;
+		sqe->len = getHeaderSize();
+		sqe->user_data = (uint64_t)(uintptr_t)s;
+		rsock->repliesInFlight++;
+	}
+	
+	if (submitUring(rsock->ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to send replies");
+	}
+	sem_post(&(rsock->lock));
+	pthread_setcancelstate(oldState, NULL);
+}
+
+// Handles every completion that is ready, until n segments have been
+// received. Sent replies are freed, and the receive is armed again if
+// it has stopped (e.g. because it ran out of buffers). Segments longer
+// than length are cut short, as recvfrom would. Neither thread can be
+// cancelled while it has the lock, or the teardown would never get it.
+static int reapCompletions(ReceiverSocket rsock, int length,
+                           Segment segments[], int sizes[], int n) {
+	int count = 0;
+	struct io_uring_cqe *cqe;
+	
+	int oldState;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+	sem_wait(&(rsock->lock));
+	while (count < n && (cqe = peekCqe(rsock->ring)) != NULL) {
+		if (cqe->user_data == RECV_TAG) {
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				sizes[count] = (cqe->res < length ? cqe->res : length);
+				memcpy(segments[count], getProvidedBuffer(rsock->ring, cqe),
+				       sizes[count]);
+				count++;
+				recycleBuffer(rsock->ring, cqe);
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				rsock->receiving = 0;
+			}
+		
+		} else if (cqe->user_data >= NUM_TAGS) {
+			// The sender may already have gone, in which case the
+			// reply is as good as lost
+			if (cqe->res < 0 && cqe->res != -ECONNREFUSED) {
+				errx(EXIT_FAILURE, "Failed to send a reply");
+			}
+			freeSegment((Segment)(uintptr_t)cqe->user_data);
+			rsock->repliesInFlight--;
+		}
+		seenCqe(rsock->ring);
+	}
+	
+	if (!rsock->receiving && !rsock->closing) {
+		armReceive(rsock);
+		if (submitUring(rsock->ring) < 0) {
+			errx(EXIT_FAILURE, "Failed to submit to io_uring");
+		}
+	}
+	sem_post(&(rsock->lock));
+	pthread_setcancelstate(oldState, NULL);
+	return count;
+}
+
+static void armReceive(ReceiverSocket rsock) {
+	struct io_uring_sqe *sqe = getSqe(rsock->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = rsock->sockfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = DATA_GROUP;
+	sqe->user_data = RECV_TAG;
+	rsock->receiving = 1;
+}
+
+// Called by the pool (with its lock held) for each of its slabs.
+// Replies in slabs that couldn't be registered go out with a send.
+static void registerSlab(void *arg, void *slab, unsigned long size) {
+	ReceiverSocket rsock = (ReceiverSocket)arg;
+	registerBuffer(rsock->ring, slab, size);
+}
@@ -4,15 +4,65 @@
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for COMP3331 18s2 Assignment
 
+#ifndef RECEIVER_SOCKET
+#define RECEIVER_SOCKET
+
+#include <netinet/in.h>
+
 #include "Segment.h"
 
 typedef struct receiverSocket *ReceiverSocket;
 
 ReceiverSocket newSocket(int recvPort);
 
+// Like newSocket, but any number of sockets can share the port
+ReceiverSocket newSharedSocket(int recvPort);
+
+int steerByConnectionId(ReceiverSocket rsock, uint nSockets);
+
+// Returns a socket that shares rsock's port, but always replies to
+// the given peer. Closing it leaves rsock open.
+ReceiverSocket newPeerSocket(ReceiverSocket rsock, struct sockaddr_in *peer);
+
 int receiveSocket(ReceiverSocket rsock, int length, Segment s);
 
 void replySocket(ReceiverSocket rsock, int length, Segment s);
 
+// Lets the kernel coalesce datagrams (GRO). Returns 0 if it isn't
+// supported.
+int enableReceiveOffload(ReceiverSocket rsock);
+
+void disableReceiveOffload(ReceiverSocket rsock);
+
+// Blocks until at least one datagram arrives, then receives up to n
+// datagrams of at most length bytes into the given segments in one
+// go. The size of each datagram goes in sizes. Returns the number of
+// datagrams received.
+int receiveSocketBatch(ReceiverSocket rsock, int length, Segment segments[],
+                       int sizes[], int n);
+
+// Like receiveSocketBatch, but gives the address each datagram came
+// from in peers rather than replying to the last one. Not for use
+// with io_uring.
+int receiveSocketBatchFrom(ReceiverSocket rsock, int length,
+                           Segment segments[], int sizes[],
+                           struct sockaddr_in peers[], int n);
+
+// Sends n header-only replies with as few system calls as possible
+void replySocketBatch(ReceiverSocket rsock, Segment segments[], int n);
+
+// Receives and replies through io_uring from now on, with the slabs
+// of the given pool as registered buffers for replies. Segments are
+// received into provided buffers of bufferSize bytes, so receive
+// offload has to be off. The socket is connected to the sender the
+// last datagram came from. Returns 0 (and changes nothing) if io_uring
+// isn't there.
+int enableUring(ReceiverSocket rsock, Pool pool, int bufferSize);
+
+// Goes back to blocking calls once all of the replies have been sent
+void disableUring(ReceiverSocket rsock);
+
 void closeSocket(ReceiverSocket rsock);
 
+#endif
+
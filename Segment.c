@@ -5,10 +5,13 @@
 
 #include <assert.h>
 #include <err.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "Checksum.h"
+#include "Pool.h"
 #include "Segment.h"
 
 typedef unsigned int uint;
@@ -18,40 +21,137 @@ struct segment {
 	uint ackNo;
 	uint windowSize;
 	uint dataLength;
-	unsigned short flags;
-	unsigned short checksum;
+	uint flags;
+	uint checksum;
+	uint connId;    // Picked by the sender for the whole connection
+	uint tsVal;     // When the segment was sent (0 if not stamped)
+	uint tsEcr;     // The tsVal being echoed back (0 if none)
 	char data[];
 };
 
+// Bookkeeping kept just in front of every segment. It is never
+// sent, since segments are sent from their header onwards.
+struct slot {
+	Pool    pool;      // NULL if the segment was malloc'd
+	Segment body;      // Where a header copy's data is (otherwise NULL)
+	int     refCount;  // Number of holders that still need the segment
+	char    padding[32 - sizeof(Pool) - sizeof(Segment) - sizeof(int)];
+};
+
+static Segment allocSegment(Pool pool, uint dataLength);
+static void initSegment(Segment s, uint seqNo, uint ackNo, uint windowSize,
+                        uint dataLength, unsigned short flags,
+                        char buffer[]);
+
 Segment newSegment(uint seqNo, uint ackNo, uint windowSize,
                    uint dataLength, unsigned short flags,
                    char buffer[]) {
-	Segment s = malloc(sizeof(struct segment) + dataLength);
-	if (s == NULL) {
-		errx(EXIT_FAILURE, "Insufficient memory! (newSegment)\n");
+	Segment s = allocSegment(NULL, dataLength);
+	initSegment(s, seqNo, ackNo, windowSize, dataLength, flags, buffer);
+	return s;
+}
+
+Segment newPooledSegment(Pool pool, uint seqNo, uint ackNo,
+                         uint windowSize, uint dataLength,
+                         unsigned short flags, char buffer[]) {
+	Segment s = allocSegment(pool, dataLength);
+	initSegment(s, seqNo, ackNo, windowSize, dataLength, flags, buffer);
+	return s;
+}
+
+// Returns an uninitialised segment with room for maxDataLength bytes
+// of data, to receive a segment into. If a pool is given, the segment
+// is taken from it and has room for as much data as its slots do.
+Segment newEmptySegment(Pool pool, uint maxDataLength) {
+	return allocSegment(pool, maxDataLength);
+}
+
+// Returns a pool whose slots can hold segments with up to
+// maxDataLength bytes of data
+Pool newSegmentPool(uint maxDataLength, uint slotsPerSlab) {
+	return newPool(sizeof(struct slot) + sizeof(struct segment) +
+	               maxDataLength, slotsPerSlab);
+}
+
+static Segment allocSegment(Pool pool, uint dataLength) {
+	struct slot *slot;
+	if (pool != NULL) {
+		assert(sizeof(struct slot) + sizeof(struct segment) + dataLength <=
+		       getSlotSize(pool));
+		slot = takeSlot(pool);
+	} else {
+		slot = malloc(sizeof(struct slot) + sizeof(struct segment) +
+		              dataLength);
+		if (slot == NULL) {
+			errx(EXIT_FAILURE, "Insufficient memory! (newSegment)\n");
+		}
 	}
-	
+	slot->pool = pool;
+	slot->body = NULL;
+	slot->refCount = 1;
+	return (Segment)(slot + 1);
+}
+
+static void initSegment(Segment s, uint seqNo, uint ackNo, uint windowSize,
+                        uint dataLength, unsigned short flags,
+                        char buffer[]) {
 	s->seqNo = seqNo;
 	s->ackNo = ackNo;
 	s->windowSize = windowSize;
 	s->dataLength = dataLength;
 	s->flags = flags;
+	s->connId = 0;
+	s->tsVal = 0;
+	s->tsEcr = 0;
 	memcpy(s->data, buffer, dataLength);
 	
 	s->checksum = calcChecksum(s);
-	
-	return s;
 }
 
 // Assumes the segment is uncorrupted, and has a correct
-// dataLength header
+// dataLength header. The copy comes from the same pool as the data.
 Segment duplicateSegment(Segment s) {
-	uint segmentSize = getHeaderSize() + s->dataLength;
-	Segment copy = malloc(segmentSize * sizeof(char));
-	memcpy(copy, s, segmentSize);
+	struct slot *slot = (struct slot *)s - 1;
+	Pool pool = (slot->body != NULL ? ((struct slot *)slot->body - 1)->pool :
+	                                  slot->pool);
+	Segment copy = allocSegment(pool, s->dataLength);
+	memcpy(copy, s, getHeaderSize());
+	memcpy(copy->data, getDataPortion(s), s->dataLength);
 	return copy;
 }
 
+// Returns a copy of just the segment's header, from a pool of
+// header-only slots, which holds on to the segment for its data. The
+// header can be changed without touching the segment, so that it can
+// be sent again without copying its data.
+Segment duplicateHeader(Pool pool, Segment s) {
+	struct slot *slot = (struct slot *)s - 1;
+	Segment copy = allocSegment(pool, 0);
+	memcpy(copy, s, getHeaderSize());
+	((struct slot *)copy - 1)->body =
+		holdSegment(slot->body != NULL ? slot->body : s);
+	return copy;
+}
+
+// Returns 1 if the segment's data isn't right after its header (it
+// is a header copy), so it must be sent from two pieces
+int isHeaderCopy(Segment s) {
+	return (((struct slot *)s - 1)->body != NULL);
+}
+
+// Adds a holder to the segment, so several parts of the sender (the
+// window, the PLD and the transmit queue) can share one segment
+// without copying it. Each holder releases it with freeSegment.
+// Holders must not modify a shared segment (other than tagging it with
+// its connection ID); use duplicateSegment or duplicateHeader to get a
+// private copy first. The sender stamps a segment in place only for
+// its first transmission, before the segment is passed on to be sent.
+Segment holdSegment(Segment s) {
+	struct slot *slot = (struct slot *)s - 1;
+	__atomic_add_fetch(&(slot->refCount), 1, __ATOMIC_RELAXED);
+	return s;
+}
+
 uint getHeaderSize(void) {
 	return sizeof(struct segment);
 }
@@ -82,7 +182,7 @@ char *getFlags(Segment s, char *str) {
 	if (s->flags & ACK) {
 		strcat(str, "A");
 	}
-	if (s->flags == 0) {
+	if ((s->flags & (SYN | FIN | ACK)) == 0) {
 		strcat(str, "D");
 	}
 	return str;
@@ -92,31 +192,78 @@ uint hasFlag(Segment s, uint flag) {
 	return (s->flags & flag);
 }
 
-unsigned short getChecksum(Segment s) {
+uint getChecksum(Segment s) {
 	return s->checksum;
 }
 
-unsigned short calcChecksum(Segment s) {
-	unsigned short checksum = 0;
-	char *end = (char *)s + getHeaderSize() + getDataLength(s);
+// Records when the segment is being sent. The timestamp is covered by
+// the checksum, so the checksum is worked out again.
+void stampSegment(Segment s, uint tsVal) {
+	s->tsVal = tsVal;
+	s->checksum = calcChecksum(s);
+}
+
+// Tags the segment with its connection, so that a receiver serving
+// several connections on one port can tell them apart. It isn't
+// covered by the checksum, so a shared segment can be tagged as it is
+// sent.
+void setConnectionId(Segment s, uint connId) {
+	__atomic_store_n(&(s->connId), connId, __ATOMIC_RELAXED);
+}
+
+uint getConnectionId(Segment s) {
+	return s->connId;
+}
+
+// Where the connection ID is in the header, for filters that look at
+// the raw datagram
+uint getConnectionIdOffset(void) {
+	return offsetof(struct segment, connId);
+}
+
+uint getTsVal(Segment s) {
+	return s->tsVal;
+}
+
+// Like stampSegment, works out the checksum again
+void setTsEcr(Segment s, uint tsEcr) {
+	s->tsEcr = tsEcr;
+	s->checksum = calcChecksum(s);
+}
+
+uint getTsEcr(Segment s) {
+	return s->tsEcr;
+}
+
+// Segments with the CRC32C flag are covered by a CRC32C of everything
+// but the checksum and the connection ID. Otherwise, the checksum is
+// the parity of every bit in the segment except those two fields and
+// the top bit of each byte (the original bit-by-bit loop used a signed
+// char mask, so it never looked at the top bit). The parity of all
+// those bits is the parity of the low 7 bits of the XOR of every byte.
+uint calcChecksum(Segment s) {
+	uint before = offsetof(struct segment, checksum);
+	uint after = offsetof(struct segment, tsVal);
 	
-	for (char *curr = (char *)s; curr != end; curr++) {
-		if (curr == (char *)(&(s->checksum))) {
-			curr++;
-		} else {
-			for (char mask = 1; mask > 0; mask <<= 1) {
-				if (*curr & mask) {
-					checksum = ~checksum;
-				}
-			}
-		}
+	uint end = getHeaderSize();
+	
+	if (hasFlag(s, CRC32C)) {
+		uint crc = crc32c(0xFFFFFFFF, (char *)s, before);
+		crc = crc32c(crc, (char *)s + after, end - after);
+		crc = crc32c(crc, getDataPortion(s), getDataLength(s));
+		return ~crc;
 	}
 	
-	return ((checksum == 0) ? 0 : 1);
+	unsigned char folded = xorBytes((char *)s, before) ^
+	                       xorBytes((char *)s + after, end - after) ^
+	                       xorBytes(getDataPortion(s), getDataLength(s));
+	
+	return __builtin_parity(folded & 0x7F);
 }
 
 char *getDataPortion(Segment s) {
-	return (s->data);
+	Segment body = ((struct slot *)s - 1)->body;
+	return (body != NULL ? body->data : s->data);
 }
 
 void showSegment(Segment s) {
@@ -138,7 +285,22 @@ void showSegment(Segment s) {
 	printf("\n=========================================\n");
 }
 
+// Releases one holder's reference to the segment. The segment is
+// only freed when the last holder releases it.
 void freeSegment(Segment s) {
-	free(s);
+	if (s == NULL) return;
+	
+	struct slot *slot = (struct slot *)s - 1;
+	if (__atomic_sub_fetch(&(slot->refCount), 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	
+	Segment body = slot->body;
+	if (slot->pool != NULL) {
+		returnSlot(slot->pool, slot);
+	} else {
+		free(slot);
+	}
+	freeSegment(body);
 }
 
@@ -6,20 +6,56 @@
 #ifndef SEGMENT_H
 #define SEGMENT_H
 
+#include "Pool.h"
+
 #define ACK 0x1
 #define SYN 0x2
 #define FIN 0x4
 
+// Checksum type. Segments without this flag carry a parity bit.
+// On a SYN it asks for CRC32C, and on the SYN/ACK it accepts it.
+#define CRC32C 0x8
+
+// On a SYN, asks the receiver to echo timestamps back in its ACKs, and
+// on the SYN/ACK agrees to
+#define TIMESTAMPS 0x10
+
+// tsVal and tsEcr hold this when there is no timestamp, so no
+// timestamp is ever given this value
+#define NO_TIMESTAMP 0
+
 typedef unsigned int uint;
 
 typedef struct segment *Segment;
 
+// Options carried in the data portion of the SYN
+typedef struct synOptions {
+	uint               mss;
+	uint               ackEvery;  // ACK every ackEvery in-order segments,
+	uint               ackDelay;  // or once one has waited ackDelay ms
+	unsigned long long offset;    // Where the data goes in the whole file
+} SynOptions;
+
 Segment newSegment(uint seqNo, uint ackNo, uint windowSize,
                    uint dataLength, unsigned short flags,
                    char buffer[]);
 
+Segment newPooledSegment(Pool pool, uint seqNo, uint ackNo,
+                         uint windowSize, uint dataLength,
+                         unsigned short flags, char buffer[]);
+
+Segment newEmptySegment(Pool pool, uint maxDataLength);
+
+Pool newSegmentPool(uint maxDataLength, uint slotsPerSlab);
+
 Segment duplicateSegment(Segment s);
 
+Segment duplicateHeader(Pool pool, Segment s);
+
+int isHeaderCopy(Segment s);
+
+Segment holdSegment(Segment s);
+
 uint getHeaderSize(void);
 
 uint getSeqNo(Segment s);
@@ -34,9 +70,23 @@ char *getFlags(Segment s, char *str);
 
 uint hasFlag(Segment s, uint flag);
 
-unsigned short getChecksum(Segment s);
+uint getChecksum(Segment s);
+
+uint calcChecksum(Segment s);
+
+void setConnectionId(Segment s, uint connId);
+
+uint getConnectionId(Segment s);
+
+uint getConnectionIdOffset(void);
+
+void stampSegment(Segment s, uint tsVal);
+
+uint getTsVal(Segment s);
+
+void setTsEcr(Segment s, uint tsEcr);
 
-unsigned short calcChecksum(Segment s);
+uint getTsEcr(Segment s);
 
 char *getDataPortion(Segment s);
 
@@ -89,7 +89,8 @@ static void updateStatistics(SenderLogger logger, Event e, Segment s) {
 	if (e & SENT) {
 		logger->numSegmentsTransmitted++;
 		
-		if (getDataLength(s) > 0) {
+		// The data in a SYN is just its options
+		if (getDataLength(s) > 0 && !hasFlag(s, SYN)) {
 			logger->numPldSegments++;
 		}
 		
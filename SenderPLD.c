@@ -23,6 +23,8 @@ struct senderPLD {
 	float pDelay;
 	uint  maxDelay;
 	
+	TimerWheel      wheel;  // Delayed segments wait on this
+	
 	SegmentToBeSent reordered;
 	uint            reorderCount;
 };
@@ -33,7 +35,7 @@ struct segmentToBeSent {
 };
 
 // We need these because C doesn't
-// support creating threads with
+// support callbacks with
 // multiple arguments -_-
 typedef struct delayedSegment {
 	SenderPLD       pld;
@@ -43,13 +45,13 @@ typedef struct delayedSegment {
 } *DelayedSegment;
 
 static void  checkReorder(SenderPLD pld, SenderLogger logger, Queue queue);
-static void *delaySegment(void *arg);
+static void  releaseDelayed(void *arg);
 static uint  getRandomDelay(SenderPLD pld);
 static float getRandomFloat(void);
 
 SenderPLD newSenderPLD(float pDrop, float pDuplicate, float pCorrupt,
                        float pOrder, uint maxOrder, float pDelay,
-                       uint maxDelay) {
+                       uint maxDelay, TimerWheel wheel) {
 	SenderPLD pld = malloc(sizeof(struct senderPLD));
 	if (pld == NULL) {
 		errx(EXIT_FAILURE, "Insufficient memory!\n");
@@ -63,6 +65,8 @@ SenderPLD newSenderPLD(float pDrop, float pDuplicate, float pCorrupt,
 	pld->pDelay = pDelay;
 	pld->maxDelay = maxDelay;
 	
+	pld->wheel = wheel;
+	
 	pld->reordered = NULL;
 	pld->reorderCount = 0;
 	return pld;
@@ -78,14 +82,14 @@ void fowardToPld(SenderPLD pld, SegmentToBeSent tbs, Queue queue,
 		printf("Dropped.\n");
 		logEvent(logger, tbs->e | DROPPED, tbs->s);
 		checkReorder(pld, logger, queue);
-		free(tbs->s); free(tbs);
+		freeSegment(tbs->s); free(tbs);
 		return;
 	}
 	
 	// DUPLICATED
 	else if (getRandomFloat() < pld->pDuplicate) {
 		printf("Duplicated.\n");
-		Segment copy = duplicateSegment(tbs->s);
+		Segment copy = holdSegment(tbs->s);
 		logEvent(logger, tbs->e, copy);
 		enterQueue(queue, copy);
 		
@@ -99,10 +103,15 @@ void fowardToPld(SenderPLD pld, SegmentToBeSent tbs, Queue queue,
 	}
 	
 	// CORRUPTED
-	// We corrupt the rightmost bit of the first data byte
+	// We corrupt the rightmost bit of the first data byte. The segment
+	// is shared with the sender window, so corrupt a private copy.
 	else if (getRandomFloat() < pld->pCorrupt) {
 		printf("Corrupted.\n");
+		Segment copy = duplicateSegment(tbs->s);
+		freeSegment(tbs->s);
+		tbs->s = copy;
 		*(getDataPortion(tbs->s)) ^= 1;
+		
 		logEvent(logger, tbs->e | CORRUPTED, tbs->s);
 		enterQueue(queue, tbs->s);
 		free(tbs);
@@ -137,9 +146,8 @@ void fowardToPld(SenderPLD pld, SegmentToBeSent tbs, Queue queue,
 		ds->queue = queue;
 		ds->tbs = tbs;
 		
-		pthread_t delayThread;
-		pthread_create(&delayThread, NULL, delaySegment, ds);
-		pthread_detach(delayThread);
+		uint delay = getRandomDelay(pld);
+		runAfter(pld->wheel, delay / 1000.0, releaseDelayed, ds);
 	}
 	
 	// NO ERROR
@@ -166,14 +174,11 @@ static void checkReorder(SenderPLD pld, SenderLogger logger, Queue queue) {
 	}
 }
 
-// Thread for subjecting segments to delay
-static void *delaySegment(void *arg) {
+// Called by the timer wheel once a delayed segment has waited long
+// enough
+static void releaseDelayed(void *arg) {
 	DelayedSegment ds = (DelayedSegment)arg;
 	
-	uint delay = getRandomDelay(ds->pld);
-	struct timespec duration = {delay / 1000, (delay % 1000) * 1000000};
-	nanosleep(&duration, NULL);
-	
 	logEvent(ds->logger, ds->tbs->e | DELAYED, ds->tbs->s);
 	enterQueue(ds->queue, ds->tbs->s);
 	
@@ -181,8 +186,6 @@ static void *delaySegment(void *arg) {
 	
 	free(ds->tbs);
 	free(ds);
-	pthread_exit(NULL);
-	return NULL;
 }
 
 // Returns a random delay in the range [0, maxDelay] in milliseconds
@@ -6,6 +6,8 @@
 #ifndef SENDER_PLD
 #define SENDER_PLD
 
+#include "TimerWheel.h"
+
 typedef struct senderPLD *SenderPLD;
 
 typedef unsigned int uint;
@@ -14,7 +16,7 @@ typedef struct segmentToBeSent *SegmentToBeSent;
 
 SenderPLD newSenderPLD(float pDrop, float pDuplicate, float pCorrupt,
                        float pOrder, uint maxOrder, float pDelay,
-                       uint maxDelay);
+                       uint maxDelay, TimerWheel wheel);
 
 void fowardToPld(SenderPLD pld, SegmentToBeSent tbs, Queue queue,
                  SenderLogger logger);
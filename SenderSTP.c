@@ -6,11 +6,16 @@
 #include <err.h>
 #include <pthread.h>
 #include <semaphore.h>
-#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <unistd.h>
 
+#include "Congestion.h"
+#include "Pacer.h"
 #include "Queue.h"
 #include "Segment.h"
 #include "SenderLogger.h"
@@ -19,10 +24,19 @@
 #include "SenderSTP.h"
 #include "SenderWindow.h"
 #include "Timer.h"
+#include "TimerWheel.h"
 
 #define TRUE  1
 #define FALSE 0
 
+#define QUEUE_CAPACITY 1024
+#define BATCH_SIZE       64
+#define SLOTS_PER_SLAB   64
+#define TICK_MS           1
+
+#define DEFAULT_CONGESTION_CONTROL "newreno"
+#define PACING_GAIN 1.25
+
 typedef unsigned int uint;
 
 struct senderSTP {
@@ -31,19 +45,39 @@ struct senderSTP {
 	SenderPLD    spld;
 	
 	SenderWindow window;
-	
-	Timer        timer;
+	Pool         dataPool;  // MSS-sized slots for data segments
+	Pool         ackPool;   // Header-only slots for ACKs
+	Pool         headerPool;  // Header copies to retransmit with
+	uint         mss;
+	Congestion   cc;        // Limits how much of the window is in flight
+	uint         rwnd;      // The window the receiver last advertised
+	Pacer        pacer;     // Spreads each window out over an RTT
+	
+	Timer        timer;     // RTT estimates and the RTO interval
+	TimerWheel   wheel;
+	WheelTimer   rto;
 	
 	uint         reorderCounter;
+	uint         checksumType;  // CRC32C if agreed on, otherwise 0
+	uint         timestamps;    // TIMESTAMPS if agreed on, otherwise 0
+	uint         connId;        // Tags every segment of the connection
+	unsigned long long offset;  // Where this connection's data starts
+	uint         ackEvery;      // Delayed ACKs asked of the receiver
+	uint         ackDelay;
+	char        *logName;
+	int          useUring;      // Transfer through io_uring
+	int          useEventLoop;  // One thread does everything
+	
+	int          numDuplicateAcks;
+	uint         duplicateAck;
 	
 	pthread_t    sendToPldThread;
-	pthread_t    receiveAcksThread;
+	pthread_t    receiveAcksThread;  // Not used with io_uring
 	pthread_t    handleAcksThread;
-	pthread_t    transmitThread;
-	pthread_t    timerThread;
-	
-	sem_t        runTimer;
-	sem_t        timerLock;
+	pthread_t    transmitThread;     // Also receives ACKs with io_uring
+	pthread_t    eventLoopThread;    // In place of all of the above
+	int          wheelFd;            // Goes off when the wheel is due
+	WheelTimer   pacingTimer;        // Wakes the loop for the pacer
 	
 	Queue        waitingToBeSent;
 	Queue        toBeTransmitted;
@@ -56,14 +90,28 @@ typedef struct segmentToBeSent {
 } *SegmentToBeSent;
 
 static void *sendSegments(void *arg);
+static void prepareSegments(SenderSTP sstp, void *batch[], uint n);
 static void *xmitSegments(void *arg);
+static void *transferSegments(void *arg);
+static void transmitBatch(SenderSTP sstp, void *batch[], uint n);
+static void *runEventLoop(void *arg);
+static void closeEpoll(void *arg);
+static uint transmitReady(SenderSTP sstp, void *segments[], uint n);
+static void onPacingTimer(void *arg);
+static void sendAgain(SenderSTP sstp, SegmentToBeSent tbs);
 
-static void *runTimer(void *arg);
+static void onTimeout(void *arg);
 static void tryToStartTimer(SenderSTP sstp);
+static void restartTimer(SenderSTP sstp);
 static void stopTimer(SenderSTP sstp);
 
 static void *receiveAcks(void *arg);
+static void freeAckBatch(void *arg);
 static void *handleAcks(void *arg);
+static void processAcks(SenderSTP sstp, void *batch[], uint n);
+static void retransmit(SenderSTP sstp, uint seqNo, Event e);
+static void updateEffectiveWindow(SenderSTP sstp);
+static uint newConnectionId(void);
 
 SenderSTP newSTP(char *recvIp, uint recvPort, uint mws, uint mss, uint gamma,
                  float pDrop, float pDuplicate, float pCorrupt, float pOrder,
@@ -75,23 +123,113 @@ SenderSTP newSTP(char *recvIp, uint recvPort, uint mws, uint mss, uint gamma,
 	}
 	sstp->ssock = newSocket(recvIp, recvPort);
 	
-	sstp->spld = newSenderPLD(pDrop, pDuplicate, pCorrupt, pOrder, maxOrder,
-	                          pDelay, maxDelay);
-	
-	sstp->window = newSenderWindow(mws, mss);
+	// Retransmissions and PLD delays are all timed on the one wheel
+	sstp->wheel = newTimerWheel(TICK_MS);
+	sstp->rto = newWheelTimer(sstp->wheel, onTimeout, sstp);
 	
+	sstp->spld = newSenderPLD(pDrop, pDuplicate, pCorrupt, pOrder, maxOrder,
+	                          pDelay, maxDelay, sstp->wheel);
+	
+	sstp->mss = mss;
+	sstp->dataPool = newSegmentPool(mss, SLOTS_PER_SLAB);
+	sstp->ackPool = newSegmentPool(0, SLOTS_PER_SLAB);
+	sstp->headerPool = newSegmentPool(0, SLOTS_PER_SLAB);
+	sstp->window = newSenderWindow(mws, mss, sstp->dataPool);
+	sstp->cc = newCongestion(DEFAULT_CONGESTION_CONTROL, mss, mws);
 	sstp->timer = newTimer(gamma);
-	
-	sem_init(&(sstp->runTimer), 0, 0);
-	sem_init(&(sstp->timerLock), 0, 1);
-	
-	sstp->waitingToBeSent = newQueue();
-	sstp->toBeTransmitted = newQueue();
-	sstp->acksQueue = newQueue();
+	sstp->pacer = newPacer(2 * (getHeaderSize() + mss));
+	sstp->rwnd = mws;
+	updateEffectiveWindow(sstp);
+	
+	sstp->checksumType = 0;
+	sstp->timestamps = TIMESTAMPS;
+	sstp->connId = newConnectionId();
+	sstp->offset = 0;
+	sstp->ackEvery = 1;
+	sstp->ackDelay = 0;
+	sstp->logName = "Sender_log.txt";
+	sstp->useUring = 0;
+	sstp->useEventLoop = 0;
+	sstp->numDuplicateAcks = 0;
+	sstp->duplicateAck = 0;
+	
+	// The event loop fills this queue as well as emptying it, so it
+	// has to fit everything that could be in flight (and the copies
+	// the PLD makes) without ever filling up
+	uint inFlight = 4 * (mws / mss + 1);
+	sstp->waitingToBeSent = newQueue(QUEUE_CAPACITY);
+	sstp->toBeTransmitted = newQueue(inFlight > QUEUE_CAPACITY ?
+	                                 inFlight : QUEUE_CAPACITY);
+	sstp->acksQueue = newSpscQueue(QUEUE_CAPACITY);
 	
 	return sstp;
 }
 
+// Asks for a checksum type other than the parity bit. It is only
+// used if the receiver agrees to it during the handshake.
+void requestChecksumType(SenderSTP sstp, uint type) {
+	sstp->checksumType = type;
+}
+
+// Has the kernel segment bursts of full-sized segments (GSO). Returns
+// 0 if it isn't supported, in which case segments are sent one by one.
+int requestSegmentOffload(SenderSTP sstp) {
+	return enableSegmentOffload(sstp->ssock, getHeaderSize() + sstp->mss);
+}
+
+// Has segments sent straight out of the window (MSG_ZEROCOPY), and
+// kept until the kernel is done with them as well as until they are
+// ACKed. Returns 0 if it isn't supported.
+int requestZeroCopy(SenderSTP sstp) {
+	return enableZeroCopy(sstp->ssock);
+}
+
+// Has segments sent and ACKs received through io_uring, if the
+// kernel supports it, once the connection is established
+void requestUring(SenderSTP sstp) {
+	sstp->useUring = 1;
+}
+
+// Has a single thread run the whole transfer from an epoll loop once
+// the connection is established, instead of a thread for each stage.
+// io_uring isn't used with it.
+void requestEventLoop(SenderSTP sstp) {
+	sstp->useEventLoop = 1;
+	sstp->useUring = 0;
+}
+
+// Asks the receiver to only ACK every ackEvery in-order segments, or
+// once the first of them has waited ackDelay ms. The receiver may
+// agree to less.
+void requestDelayedAcks(SenderSTP sstp, uint ackEvery, uint ackDelay) {
+	sstp->ackEvery = (ackEvery > 0 ? ackEvery : 1);
+	sstp->ackDelay = ackDelay;
+}
+
+// When a file is striped over several connections, tells the receiver
+// where in the file this connection's data goes
+void setRangeOffset(SenderSTP sstp, unsigned long long offset) {
+	sstp->offset = offset;
+}
+
+// The name is kept, not copied
+void setLogName(SenderSTP sstp, char *logName) {
+	sstp->logName = logName;
+}
+
+// Picks the congestion control algorithm for the connection (see
+// Congestion.h). Returns 0 if there is no such algorithm.
+int setCongestionControl(SenderSTP sstp, char *algorithm) {
+	Congestion cc = newCongestion(algorithm, sstp->mss,
+	                              getMws(sstp->window));
+	if (cc == NULL) return 0;
+	
+	freeCongestion(sstp->cc);
+	sstp->cc = cc;
+	updateEffectiveWindow(sstp);
+	return 1;
+}
+
 static SegmentToBeSent newSegmentToBeSent(Segment s, Event e) {
 	SegmentToBeSent new = malloc(sizeof(struct segmentToBeSent));
 	new->s = s;
@@ -119,13 +257,51 @@ void pushDataToSTP(SenderSTP sstp, uint length, char data[]) {
 	enterQueue(sstp->waitingToBeSent, tbs);
 }
 
+// Never blocks on a full window. Sends as much of the data as the
+// window has space for, in MSS-sized segments, and returns the
+// number of bytes that were accepted.
+uint tryPushDataToSTP(SenderSTP sstp, uint length, char data[]) {
+	uint total = 0;
+	while (total < length) {
+		Segment s;
+		uint accepted = tryBufferData(sstp->window, length - total,
+		                              data + total, &s);
+		if (accepted == 0) break;
+		
+		updateFileSizeStatistic(sstp->slogger, accepted);
+		enterQueue(sstp->waitingToBeSent, newSegmentToBeSent(s, SENT));
+		total += accepted;
+	}
+	return total;
+}
+
 // Thread for sending segments to the PLD
+// Takes every segment that is waiting to be sent off the queue
+// at once, so the timer is only touched once per wakeup
+// Like the other threads, it can only be cancelled while it waits, so
+// it never stops holding a lock (the logger's, say) or half way
+// through a batch.
 static void *sendSegments(void *arg) {
 	SenderSTP sstp = (SenderSTP)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	void *batch[BATCH_SIZE];
 	
 	while (1) {
-		// Grab next segment to be sent off the queue
-		SegmentToBeSent tbs = leaveQueue(sstp->waitingToBeSent);
+		// Grab the next segments to be sent off the queue
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		uint n = leaveQueueBatch(sstp->waitingToBeSent, batch, BATCH_SIZE);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		prepareSegments(sstp, batch, n);
+	}
+	
+	return NULL;
+}
+
+// Stamps a batch of segments that are about to be sent, starts the
+// RTO if it isn't running, and passes them on to the PLD
+static void prepareSegments(SenderSTP sstp, void *batch[], uint n) {
+	for (uint i = 0; i < n; i++) {
+		SegmentToBeSent tbs = batch[i];
 		tbs->e |= SENT;
 		
 		// Determine if this segment is being retransmitted
@@ -133,75 +309,318 @@ static void *sendSegments(void *arg) {
 		
 		// If the segment is not being retransmitted,  update the
 		// lastByteSent. If we are currently not sampling the RTT
-		// for a segment, start sampling the RTT.
+		// for a segment (and can't use timestamps), start sampling
+		// the RTT.
 		if (!rexmit) {
 			updateLastByteSent(sstp->window, tbs->s);
-			if (!isSamplingRTT(sstp->timer)) {
+			if (!sstp->timestamps && !isSamplingRTT(sstp->timer)) {
 				printf("Starting a sampling of segment with seq no. %d\n", getSeqNo(tbs->s));
 				startSamplingRTT(sstp->timer, tbs->s);
 			}
 		}
 		
-		// Start the RTO (if it has not already been started) and
-		// forward the segment to the PLD module.
-		tryToStartTimer(sstp);
-		fowardToPld(sstp->spld, tbs, sstp->toBeTransmitted, sstp->slogger);
-		
+		// With timestamps, the ACK for every transmission (even a
+		// retransmission) gives a sample of the RTT. Stamping changes
+		// the checksum, and an earlier transmission of a retransmitted
+		// segment may still be on its way out, so a retransmission is
+		// stamped on a copy of its header, which shares the data. A
+		// first transmission has no other sender yet, so it is stamped
+		// in place.
+		if (sstp->timestamps) {
+			if (rexmit) {
+				Segment copy = duplicateHeader(sstp->headerPool, tbs->s);
+				freeSegment(tbs->s);
+				tbs->s = copy;
+			}
+			stampSegment(tbs->s, getTimestamp(sstp->timer));
+		}
+		setConnectionId(tbs->s, sstp->connId);
 	}
 	
-	return NULL;
+	// Start the RTO (if it has not already been started) and
+	// forward the segments to the PLD module.
+	tryToStartTimer(sstp);
+	for (uint i = 0; i < n; i++) {
+		fowardToPld(sstp->spld, batch[i], sstp->toBeTransmitted,
+		            sstp->slogger);
+	}
 }
 
 // Thread for transmitting segments
 static void *xmitSegments(void *arg) {
 	SenderSTP sstp = (SenderSTP)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	void *batch[BATCH_SIZE];
 	
 	while (1) {
-		Segment s = leaveQueue(sstp->toBeTransmitted);
-		sendSocket(sstp->ssock, getDataLength(s), s);
-		freeSegment(s); // C memory management :(
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		uint n = leaveQueueBatch(sstp->toBeTransmitted, batch, BATCH_SIZE);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		transmitBatch(sstp, batch, n);
 	}
 	
 	return NULL;
 }
 
-// Thread for maintaining the timer
-static void *runTimer(void *arg) {
+// Thread for transmitting segments and receiving ACKs through
+// io_uring, in place of xmitSegments and receiveAcks
+// Sends whatever is waiting to be transmitted and picks up the ACKs
+// that have come in. When there is nothing to send, it waits for
+// whichever comes first: an ACK, or something to send.
+static void *transferSegments(void *arg) {
 	SenderSTP sstp = (SenderSTP)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	void *batch[BATCH_SIZE];
+	
+	Segment acks[BATCH_SIZE];
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		acks[i] = newEmptySegment(sstp->ackPool, 0);
+	}
+	pthread_cleanup_push(freeAckBatch, acks);
 	
 	while (1) {
-		sem_wait(&(sstp->runTimer));
-		printf("Starting timer...\n");
-		double timeRemaining = startTimer(sstp->timer);
+		uint n = tryLeaveQueueBatch(sstp->toBeTransmitted, batch, BATCH_SIZE);
+		transmitBatch(sstp, batch, n);
 		
-		// If there is a timeout...
-		if (timeRemaining == 0) {
-			printf("Timeout (RTO was %lf)\n", getTimeOutInterval(sstp->timer));
-			Segment s = getBaseSegment(sstp->window);
-			cancelSamplingRTT(sstp->timer);
-			
-			SegmentToBeSent tbs;
-			tbs = newSegmentToBeSent(s, TIMEOUT_REXMIT);
-			enterQueue(sstp->waitingToBeSent, tbs);
-			tryToStartTimer(sstp);
+		int wakeFd = (n == 0 ? prepareToWait(sstp->toBeTransmitted) : -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int nAcks = awaitReplies(sstp->ssock, acks, BATCH_SIZE, wakeFd);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (wakeFd >= 0) {
+			finishWaiting(sstp->toBeTransmitted);
+		}
+		
+		for (int i = 0; i < nAcks; i++) {
+			enterQueue(sstp->acksQueue, acks[i]);
+			acks[i] = newEmptySegment(sstp->ackPool, 0);
 		}
 	}
 	
+	pthread_cleanup_pop(1);
 	return NULL;
 }
 
+// Segments go out in as few system calls as the pacer allows: the
+// ones that can go straight away are sent together, and whatever has
+// built up is sent before the pacer makes us wait
+static void transmitBatch(SenderSTP sstp, void *batch[], uint n) {
+	uint first = 0;
+	for (uint i = 0; i < n; i++) {
+		uint bytes = getHeaderSize() + getDataLength(batch[i]);
+		if (i > first && !canSendNow(sstp->pacer, bytes)) {
+			if (sstp->useUring) {
+				submitSegments(sstp->ssock, (Segment *)batch + first,
+				               i - first);
+			} else {
+				sendSocketBatch(sstp->ssock, (Segment *)batch + first,
+				                i - first);
+			}
+			first = i;
+		}
+		pace(sstp->pacer, bytes);
+	}
+	
+	// io_uring frees the segments once they have been sent
+	if (sstp->useUring) {
+		submitSegments(sstp->ssock, (Segment *)batch + first, n - first);
+		return;
+	}
+	
+	sendSocketBatch(sstp->ssock, (Segment *)batch + first, n - first);
+	for (uint i = 0; i < n; i++) {
+		freeSegment(batch[i]); // Drop our reference (C memory management :( )
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Event loop
+
+// Thread that runs the whole transfer, in place of all of the others
+// Each time round, it handles the ACKs that have come in, passes new
+// segments through the PLD, and sends whatever the pacer lets out.
+// Only once a pass finds nothing to do does it sleep, until an ACK
+// arrives, the timer wheel is due (an RTO, a PLD delay or the pacer)
+// or there is new data to send.
+static void *runEventLoop(void *arg) {
+	SenderSTP sstp = (SenderSTP)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	
+	int sockFd = getSocketFd(sstp->ssock);
+	int dataFd = -1;  // Added the first time we wait for data
+	
+	int epollFd = epoll_create1(0);
+	if (epollFd < 0) {
+		errx(EXIT_FAILURE, "Couldn't create an epoll instance");
+	}
+	struct epoll_event event = { .events = EPOLLIN };
+	event.data.fd = sockFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, sockFd, &event);
+	event.data.fd = sstp->wheelFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, sstp->wheelFd, &event);
+	pthread_cleanup_push(closeEpoll, &epollFd);
+	
+	Segment acks[BATCH_SIZE];
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		acks[i] = newEmptySegment(sstp->ackPool, 0);
+	}
+	pthread_cleanup_push(freeAckBatch, acks);
+	
+	void *batch[BATCH_SIZE];
+	void *unsent[BATCH_SIZE];  // Segments the pacer has held back
+	uint nUnsent = 0;
+	
+	while (1) {
+		int busy = FALSE;
+		
+		int nAcks = socketTryGetReplies(sstp->ssock, acks, BATCH_SIZE);
+		if (nAcks > 0) {
+			processAcks(sstp, (void **)acks, nAcks);
+			for (int i = 0; i < nAcks; i++) {
+				acks[i] = newEmptySegment(sstp->ackPool, 0);
+			}
+			busy = TRUE;
+		}
+		
+		uint n = tryLeaveQueueBatch(sstp->waitingToBeSent, batch, BATCH_SIZE);
+		if (n > 0) {
+			prepareSegments(sstp, batch, n);
+			busy = TRUE;
+		}
+		
+		nUnsent += tryLeaveQueueBatch(sstp->toBeTransmitted, unsent + nUnsent,
+		                              BATCH_SIZE - nUnsent);
+		uint sent = transmitReady(sstp, unsent, nUnsent);
+		if (sent > 0) {
+			nUnsent -= sent;
+			memmove(unsent, unsent + sent, nUnsent * sizeof(void *));
+			busy = TRUE;
+		}
+		
+		// Go round again straight away after doing anything, and
+		// sleep once there is nothing to do
+		int timeout = 0;
+		int waiting = FALSE;
+		if (!busy) {
+			int fd = prepareToWait(sstp->waitingToBeSent);
+			if (fd >= 0) {
+				if (dataFd < 0) {
+					dataFd = fd;
+					event.data.fd = dataFd;
+					epoll_ctl(epollFd, EPOLL_CTL_ADD, dataFd, &event);
+				}
+				waiting = TRUE;
+				timeout = -1;
+			}
+		}
+		
+		struct epoll_event ready[3];
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int nReady = epoll_wait(epollFd, ready, 3, timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (waiting) {
+			finishWaiting(sstp->waitingToBeSent);
+		}
+		
+		for (int i = 0; i < nReady; i++) {
+			if (ready[i].data.fd == sstp->wheelFd) {
+				runTimerWheel(sstp->wheel);
+			} else if (ready[i].data.fd == dataFd) {
+				uint64_t count;
+				if (read(dataFd, &count, sizeof(count)) < 0) {
+					errx(EXIT_FAILURE, "Failed to read from the queue");
+				}
+			}
+		}
+	}
+	
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void closeEpoll(void *arg) {
+	close(*(int *)arg);
+}
+
+// Sends as many of the segments as the pacer lets out right now, in
+// one go, and returns how many were sent. If it holds any back, the
+// pacing timer is set for when they can go.
+static uint transmitReady(SenderSTP sstp, void *segments[], uint n) {
+	uint ready = 0;
+	while (ready < n) {
+		uint bytes = getHeaderSize() + getDataLength(segments[ready]);
+		if (!canSendNow(sstp->pacer, bytes)) {
+			armTimerIfIdle(sstp->pacingTimer,
+			               getPacingDelay(sstp->pacer, bytes));
+			break;
+		}
+		pace(sstp->pacer, bytes);
+		ready++;
+	}
+	
+	if (ready > 0) {
+		sendSocketBatch(sstp->ssock, (Segment *)segments, ready);
+		for (uint i = 0; i < ready; i++) {
+			freeSegment(segments[i]);
+		}
+	}
+	return ready;
+}
+
+// The pacing timer only has to wake the event loop up, which then
+// sends whatever the pacer lets out
+static void onPacingTimer(void *arg) {
+	(void)arg;
+}
+
+// Called by the timer wheel when the RTO runs out
+// Retransmits the oldest unacknowledged segment
+static void onTimeout(void *arg) {
+	SenderSTP sstp = (SenderSTP)arg;
+	
+	printf("Timeout (RTO was %lf)\n", getTimeOutInterval(sstp->timer));
+	Segment s = getBaseSegment(sstp->window);
+	cancelSamplingRTT(sstp->timer);
+	
+	// Everything may have been ACKed just as the timer ran out
+	if (s == NULL) return;
+	
+	ccOnTimeout(sstp->cc, getNextSeqNo(sstp->window) -
+	                      getSendBase(sstp->window));
+	updateEffectiveWindow(sstp);
+	
+	SegmentToBeSent tbs;
+	tbs = newSegmentToBeSent(s, TIMEOUT_REXMIT);
+	sendAgain(sstp, tbs);
+	tryToStartTimer(sstp);
+}
+
+// Sends a segment again. The event loop passes it on itself, since it
+// is the one that would otherwise take it off the queue.
+static void sendAgain(SenderSTP sstp, SegmentToBeSent tbs) {
+	if (sstp->useEventLoop) {
+		void *batch[1] = { tbs };
+		prepareSegments(sstp, batch, 1);
+	} else {
+		enterQueue(sstp->waitingToBeSent, tbs);
+	}
+}
+
+// Starts the RTO, unless it is already running
 static void tryToStartTimer(SenderSTP sstp) {
-	int sval;
-	sem_wait(&(sstp->timerLock));
-	sem_getvalue(&(sstp->runTimer), &sval);
-	if (sval == 0) {
-		sem_post(&(sstp->runTimer));
+	if (armTimerIfIdle(sstp->rto, getTimeOutInterval(sstp->timer))) {
+		printf("Starting timer...\n");
 	}
-	sem_post(&(sstp->timerLock));
+}
+
+// Starts the RTO again from the beginning
+static void restartTimer(SenderSTP sstp) {
+	printf("Starting timer...\n");
+	armTimer(sstp->rto, getTimeOutInterval(sstp->timer));
 }
 
 static void stopTimer(SenderSTP sstp) {
-	pthread_kill(sstp->timerThread, SIGALRM);
+	cancelTimer(sstp->rto);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -212,50 +631,107 @@ static void stopTimer(SenderSTP sstp) {
 // from the receiver
 static void *receiveAcks(void *arg) {
 	SenderSTP sstp = (SenderSTP)arg;
-	Segment s = malloc(20);
-	int segmentSize;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	
+	Segment batch[BATCH_SIZE];
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		batch[i] = newEmptySegment(sstp->ackPool, 0);
+	}
+	pthread_cleanup_push(freeAckBatch, batch);
+	
+	// Receive a batch of ACKs straight into slots from the ACK pool
 	while (1) {
-		segmentSize = socketGetReply(sstp->ssock, s);
-		Segment copy = malloc(segmentSize * sizeof(char));
-		memcpy(copy, s, segmentSize); // Copy the segment
-		enterQueue(sstp->acksQueue, copy);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int n = socketGetReplies(sstp->ssock, batch, BATCH_SIZE);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		for (int i = 0; i < n; i++) {
+			enterQueue(sstp->acksQueue, batch[i]);
+			batch[i] = newEmptySegment(sstp->ackPool, 0);
+		}
 	}
 	
+	pthread_cleanup_pop(1);
 	return NULL;
 }
 
+// Gives the unused ACK slots back when receiveAcks is cancelled
+static void freeAckBatch(void *arg) {
+	Segment *batch = (Segment *)arg;
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		if (batch[i] != NULL) freeSegment(batch[i]);
+	}
+}
+
 // Thread for handling ACKs
-// Grabs ACK segments off the queue one at a time, and then
-// handles them accordingly
+// Grabs all of the ACK segments that are waiting on the queue, and
+// then handles them accordingly. The timer is stopped and the window
+// is slid only once per batch, up to the highest new ACK.
+// Every ACK is also passed on to congestion control, which decides
+// how much of the window can be used once the batch is done.
 static void *handleAcks(void *arg) {
 	SenderSTP sstp = (SenderSTP)arg;
-	int numDuplicateAcks = 0;
-	int duplicateAck = 0;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	void *batch[BATCH_SIZE];
 	
 	while (1) {
-		Segment s = leaveQueue(sstp->acksQueue);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		uint n = leaveQueueBatch(sstp->acksQueue, batch, BATCH_SIZE);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		processAcks(sstp, batch, n);
+	}
+	
+	return NULL;
+}
+
+// Handles a batch of ACKs, and frees them
+static void processAcks(SenderSTP sstp, void *batch[], uint n) {
+	uint sendBase = getSendBase(sstp->window);
+	int newAckReceived = FALSE;
+	
+	for (uint i = 0; i < n; i++) {
+		Segment s = batch[i];
 		uint ackNo = getAckNo(s);
 		printf("Received ACK %d ", ackNo);
 		
+		// ACKs can arrive out of order, so only take the window from
+		// ones that aren't behind
+		uint lastRwnd = sstp->rwnd;
+		if (ackNo >= sendBase) {
+			sstp->rwnd = getWindowSize(s);
+		}
+		
+		// A corrupted ACK could echo a bogus timestamp. As in RFC
+		// 7323, only an ACK for new data gives a sample: the receiver
+		// echoes the same timestamp in its duplicate ACKs, which would
+		// make the RTT look longer with every one of them.
+		if (sstp->timestamps && ackNo > sendBase &&
+		    getChecksum(s) == calcChecksum(s)) {
+			ccOnRttSample(sstp->cc,
+			              sampleEchoedRTT(sstp->timer, getTsEcr(s)));
+		}
+		
 		// If a new ACK was received
-		if (ackNo > getSendBase(sstp->window)) {
+		if (ackNo > sendBase) {
 			printf("(NEW)\n");
 			if (isSamplingRTT(sstp->timer) &&
 					(ackNo > getSampledSeqNo(sstp->timer))) {
 				printf("Taking a sample of RTT, ack no. is %d\n", ackNo);
-				stopSamplingRTT(sstp->timer);
+				ccOnRttSample(sstp->cc, stopSamplingRTT(sstp->timer));
 			}
 			
-			numDuplicateAcks = 0;
+			sstp->numDuplicateAcks = 0;
 			
-			stopTimer(sstp);
 			logEvent(sstp->slogger, RECEIVED, s);
-			// Update the sender window
-			if (slideWindow(sstp->window, ackNo))  {
-				printf("There are still unacked segments\n");
-				tryToStartTimer(sstp);
+			
+			// A partial ACK during recovery means the segment at
+			// ackNo was lost as well
+			if (ccOnNewAck(sstp->cc, ackNo, ackNo - sendBase)) {
+				printf("Partial ACK, retransmitting %d\n", ackNo);
+				retransmit(sstp, ackNo, FAST_REXMIT);
 			}
+			
+			sendBase = ackNo;
+			newAckReceived = TRUE;
 		}
 		
 		// If a duplicate ACK was received
@@ -264,40 +740,102 @@ static void *handleAcks(void *arg) {
 			
 			logEvent(sstp->slogger, RECEIVED | DUPLICATE_ACK, s);
 			
-			// Ignore ACKs below the window
-			if (ackNo == getSendBase(sstp->window)) {
-				if (ackNo > duplicateAck) {
-					numDuplicateAcks = 0;
-					duplicateAck = ackNo;
+			// Ignore ACKs below the window, and window updates (an ACK
+			// that changes the window isn't a duplicate, as in RFC
+			// 5681). During recovery, each duplicate ACK just lets
+			// another segment out.
+			if (sstp->rwnd != lastRwnd) {
+				printf("Window update, window is now %d\n", sstp->rwnd);
+			} else if (ackNo == sendBase && inRecovery(sstp->cc)) {
+				ccOnDupAck(sstp->cc);
+			} else if (ackNo == sendBase) {
+				if (ackNo > sstp->duplicateAck) {
+					sstp->numDuplicateAcks = 0;
+					sstp->duplicateAck = ackNo;
 				}
-				numDuplicateAcks++;
+				sstp->numDuplicateAcks++;
 				
 				// Fast retransmit
-				if (numDuplicateAcks == 3) {
-					numDuplicateAcks = 0;  // Reset duplicate ACK count to zero
+				if (sstp->numDuplicateAcks == 3) {
+					sstp->numDuplicateAcks = 0;  // Reset duplicate ACK count to zero
 					
 					// If the duplicate ACK number is the same as the  sequence
 					// number of the segment we are using to sample RTT, cancel
 					// the sampling of the RTT
 					cancelSamplingRTT(sstp->timer);
 					
-					// Get the segment that has the same sequence number as the
-					// duplicate ACK number
-					Segment retransmitted = getSegment(sstp->window, ackNo);
-					if (retransmitted == NULL) {
-						continue;
-					}
-					
-					// Enqueue this segment on the queue of segments to be sent
-					SegmentToBeSent tbs = newSegmentToBeSent(retransmitted,
-						                                     FAST_REXMIT);
-					enterQueue(sstp->waitingToBeSent, tbs);
+					ccOnFastRetransmit(sstp->cc,
+					                   getNextSeqNo(sstp->window) - sendBase,
+					                   getLastByteSent(sstp->window));
+					retransmit(sstp, ackNo, FAST_REXMIT);
 				}
 			}
 		}
+		
+		freeSegment(s);
 	}
 	
-	return NULL;
+	if (newAckReceived) {
+		// Update the sender window
+		if (slideWindow(sstp->window, sendBase))  {
+			printf("There are still unacked segments\n");
+			restartTimer(sstp);
+		} else {
+			stopTimer(sstp);
+			
+			// A segment sent after the window was slid would have
+			// found the timer still running, so check again
+			Segment s = getBaseSegment(sstp->window);
+			if (s != NULL) {
+				freeSegment(s);
+				tryToStartTimer(sstp);
+			}
+		}
+	}
+	updateEffectiveWindow(sstp);
+}
+
+// Retransmits the segment with the given sequence no.
+static void retransmit(SenderSTP sstp, uint seqNo, Event e) {
+	// The window has not been slid yet, so the segment is
+	// still buffered if seqNo is the send base
+	Segment retransmitted = getSegment(sstp->window, seqNo);
+	if (retransmitted != NULL) {
+		// Enqueue this segment on the queue of segments to be sent
+		SegmentToBeSent tbs = newSegmentToBeSent(retransmitted, e);
+		sendAgain(sstp, tbs);
+	}
+}
+
+// Lets the sender window use as much of itself as congestion control
+// and the receiver allow, and paces it so that a window goes out over
+// about an RTT (a little faster, so the window can still grow). There
+// is no pacing until there is an RTT estimate. With delayed ACKs, the
+// smoothed RTT includes the time the receiver held its ACKs back, and
+// spreading the window out over that long would only keep it waiting
+// longer for the rest of each group, so the window is paced over the
+// shortest RTT instead.
+// One segment is always let out even if the receiver has no room, so
+// that its retransmissions find out when it does again.
+static void updateEffectiveWindow(SenderSTP sstp) {
+	uint window = getCongestionWindow(sstp->cc);
+	uint rwnd = (sstp->rwnd > sstp->mss ? sstp->rwnd : sstp->mss);
+	if (rwnd < window) window = rwnd;
+	setEffectiveWindow(sstp->window, window);
+	
+	double rtt = (sstp->ackEvery > 1 ? getMinRtt(sstp->cc)
+	                                 : getSmoothedRTT(sstp->timer));
+	setPacingRate(sstp->pacer, rtt > 0 ? PACING_GAIN * window / rtt : 0);
+}
+
+// Connection IDs are random, so that transfers from the same address
+// to a receiver serving several connections are unlikely to collide
+static uint newConnectionId(void) {
+	uint connId;
+	if (getrandom(&connId, sizeof(connId), 0) != sizeof(connId)) {
+		connId = getpid();
+	}
+	return connId;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -305,50 +843,103 @@ static void *handleAcks(void *arg) {
 // through the three-way handshake.
 // Also initiate the logger.
 void establishSTP(SenderSTP sstp) {
-	sstp->slogger = newSenderLogger("Sender_log.txt");
+	sstp->slogger = newSenderLogger(sstp->logName);
 	
 	Segment s;
 	
-	// Sending a SYN
-	s = newSegment(0, 0, getMws(sstp->window),
-	               0, SYN, NULL);
+	// Sending a SYN, asking for the checksum type we want, for
+	// timestamps and for delayed ACKs, and telling the receiver our MSS
+	SynOptions options = {
+		.mss = sstp->mss, .offset = sstp->offset,
+		.ackEvery = sstp->ackEvery, .ackDelay = sstp->ackDelay
+	};
+	s = newSegment(0, 0, getMws(sstp->window), sizeof(options),
+	               SYN | sstp->checksumType | sstp->timestamps,
+	               (char *)&options);
+	setConnectionId(s, sstp->connId);
 	logEvent(sstp->slogger, SENT, s);
-	sendSocket(sstp->ssock, 0, s);
+	sendSocket(sstp->ssock, sizeof(options), s);
 	freeSegment(s);
 	
-	// Receiving a SYN/ACK
-	s = malloc(20);
+	// Receiving a SYN/ACK, which tells us if the receiver
+	// agreed to the checksum type and to timestamps
+	s = newEmptySegment(NULL, 0);
 	socketGetReply(sstp->ssock, s);
 	logEvent(sstp->slogger, RECEIVED, s);
+	sstp->checksumType = hasFlag(s, sstp->checksumType);
+	sstp->timestamps = hasFlag(s, sstp->timestamps);
+	
+	setChecksumType(sstp->window, sstp->checksumType);
+	setSegmentsPerAck(sstp->cc, sstp->ackEvery);
 	freeSegment(s);
 	
 	// Sending an ACK
 	s = newSegment(1, 1, getMws(sstp->window),
-	               0, ACK, NULL);
+	               0, ACK | sstp->checksumType, NULL);
+	setConnectionId(s, sstp->connId);
 	logEvent(sstp->slogger, SENT, s);
 	sendSocket(sstp->ssock, 0, s);
 	freeSegment(s);
 	
-	// Initiate threads
-	pthread_create(&(sstp->transmitThread), NULL, xmitSegments, sstp);
+	if (sstp->useUring && !enableUring(sstp->ssock, sstp->dataPool)) {
+		warnx("io_uring isn't available, using blocking sockets");
+		sstp->useUring = 0;
+	}
+	
+	// Initiate threads. The event loop runs the timer wheel itself.
+	if (sstp->useEventLoop) {
+		sstp->wheelFd = takeOverTimerWheel(sstp->wheel);
+		sstp->pacingTimer = newWheelTimer(sstp->wheel, onPacingTimer, sstp);
+		pthread_create(&(sstp->eventLoopThread), NULL, runEventLoop, sstp);
+		return;
+	}
+	if (sstp->useUring) {
+		pthread_create(&(sstp->transmitThread), NULL, transferSegments, sstp);
+	} else {
+		pthread_create(&(sstp->transmitThread), NULL, xmitSegments, sstp);
+		pthread_create(&(sstp->receiveAcksThread), NULL, receiveAcks, sstp);
+	}
 	pthread_create(&(sstp->sendToPldThread), NULL, sendSegments, sstp);
-	pthread_create(&(sstp->receiveAcksThread), NULL, receiveAcks, sstp);
 	pthread_create(&(sstp->handleAcksThread), NULL, handleAcks, sstp);
-	pthread_create(&(sstp->timerThread), NULL, runTimer, sstp);
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Teardown the connection on the sender's side
 // through the four-step connection termination
 void teardownSTP(SenderSTP sstp) {
-	while (getSendBase(sstp->window) != getNextSeqNo(sstp->window));
+	waitUntilAllAcked(sstp->window);
 	
 	// Terminate threads
-	pthread_cancel(sstp->timerThread);
-	pthread_cancel(sstp->transmitThread);
-	pthread_cancel(sstp->handleAcksThread);
-	pthread_cancel(sstp->receiveAcksThread);
-	pthread_cancel(sstp->sendToPldThread);
+	if (sstp->useEventLoop) {
+		pthread_cancel(sstp->eventLoopThread);
+		pthread_join(sstp->eventLoopThread, NULL);
+		freeWheelTimer(sstp->pacingTimer);
+	} else {
+		pthread_cancel(sstp->transmitThread);
+		pthread_cancel(sstp->handleAcksThread);
+		if (!sstp->useUring) {
+			pthread_cancel(sstp->receiveAcksThread);
+		}
+		pthread_cancel(sstp->sendToPldThread);
+		
+		pthread_join(sstp->transmitThread, NULL);
+		pthread_join(sstp->handleAcksThread, NULL);
+		if (!sstp->useUring) {
+			pthread_join(sstp->receiveAcksThread, NULL);
+		}
+		pthread_join(sstp->sendToPldThread, NULL);
+	}
+	
+	// Nothing arms the RTO once the threads are gone, but the timeout
+	// might still be running on the wheel's thread (and re-arming it,
+	// if it fired just before the last ACK), so stop the wheel first
+	stopTimerWheel(sstp->wheel);
+	freeWheelTimer(sstp->rto);
+	freeTimerWheel(sstp->wheel);
+	
+	// The rest of the teardown uses blocking calls again
+	disableUring(sstp->ssock);
+	finishZeroCopy(sstp->ssock);
 	
 	// Waste time
 	for (int i = 0; i < 1000; i++) {
@@ -362,13 +953,14 @@ void teardownSTP(SenderSTP sstp) {
 	// Sending a FIN
 	s = newSegment(nextSeqNo++, 1,
 	               getMws(sstp->window),
-	               0, FIN, NULL);
+	               0, FIN | sstp->checksumType, NULL);
+	setConnectionId(s, sstp->connId);
 	logEvent(sstp->slogger, SENT, s);
 	sendSocket(sstp->ssock, 0, s);
 	freeSegment(s);
 	
 	// Receiving an ACK
-	s = malloc(20);
+	s = newEmptySegment(NULL, 0);
 	socketGetReply(sstp->ssock, s);
 	logEvent(sstp->slogger, RECEIVED, s);
 	freeSegment(s);
@@ -376,7 +968,7 @@ void teardownSTP(SenderSTP sstp) {
 	printf("Waiting for the FIN\n");
 	
 	// Receiving a FIN
-	s = malloc(20);
+	s = newEmptySegment(NULL, 0);
 	socketGetReply(sstp->ssock, s);
 	logEvent(sstp->slogger, RECEIVED, s);
 	freeSegment(s);
@@ -392,12 +984,17 @@ void teardownSTP(SenderSTP sstp) {
 	// Sending an ACK
 	s = newSegment(nextSeqNo, 2,
 	               getMws(sstp->window),
-	               0, ACK, NULL);
+	               0, ACK | sstp->checksumType, NULL);
+	setConnectionId(s, sstp->connId);
 	logEvent(sstp->slogger, SENT, s);
 	sendSocket(sstp->ssock, 0, s);
 	freeSegment(s);
 	
 	logSummary(sstp->slogger);
+	showPool(sstp->dataPool, "data segments");
+	showPool(sstp->ackPool, "ACKs");
+	showPool(sstp->headerPool, "header copies");
+	showPacer(sstp->pacer);
 	closeSocket(sstp->ssock);
 }
 
@@ -15,8 +15,28 @@ SenderSTP newSTP(char *recvIp, uint recvPort, uint mws, uint mss, uint gamma,
                  float pDrop, float pDuplicate, float pCorrupt, float pOrder,
                  uint maxOrder, float pDelay, uint maxDelay);
 
+void requestChecksumType(SenderSTP sstp, uint type);
+
+int setCongestionControl(SenderSTP sstp, char *algorithm);
+
+int requestSegmentOffload(SenderSTP sstp);
+
+int requestZeroCopy(SenderSTP sstp);
+
+void requestUring(SenderSTP sstp);
+
+void requestEventLoop(SenderSTP sstp);
+
+void requestDelayedAcks(SenderSTP sstp, uint ackEvery, uint ackDelay);
+
+void setRangeOffset(SenderSTP sstp, unsigned long long offset);
+
+void setLogName(SenderSTP sstp, char *logName);
+
 void pushDataToSTP(SenderSTP sstp, uint length, char data[]);
 
+uint tryPushDataToSTP(SenderSTP sstp, uint length, char data[]);
+
 void establishSTP(SenderSTP sstp);
 
 void teardownSTP(SenderSTP sstp);
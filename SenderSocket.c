@@ -3,22 +3,107 @@
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
+#define _GNU_SOURCE  // For sendmmsg and recvmmsg
+
 #include <arpa/inet.h>
 #include <err.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "Segment.h"
 #include "SenderSocket.h"
+#include "Uring.h"
+
+#define MAX_BATCH 64
+
+// Limits on how much the kernel will segment from one send
+#define MAX_GSO_SEGMENTS 64
+#define MAX_GSO_BYTES    65000
+
+// Zero-copy
+#define HEADERS_PER_SLAB 64
+#define ZEROCOPY_WAIT    1000  // Milliseconds to wait for completions
+#define ZEROCOPY_PROBE   32    // Sends to see if the kernel really can
+
+// A zero-copy send can only be spread over so many pages (fragments)
+// of memory. MAX_SKB_FRAGS is 17 by default, and pages are at least
+// this big.
+#define MAX_ZEROCOPY_FRAGS 16
+#define MIN_PAGE_SIZE      4096
+
+// io_uring
+#define URING_ENTRIES    256
+#define MAX_REGISTERED   64   // Slabs that can be registered buffers
+#define REPLY_BUFFERS    256  // Provided buffers for replies
+#define REPLY_GROUP      0
+
+// Completions that aren't for a send carry one of these instead of
+// the segment that was sent
+#define RECV_TAG   1
+#define WAKE_TAG   2
+#define CANCEL_TAG 3
+#define NUM_TAGS   4
+
+// A segment sent with MSG_ZEROCOPY, which the kernel may still be
+// reading from. Its header is sent from a copy, since the segment's
+// own header can be stamped again for a retransmission.
+struct zeroCopySend {
+	uint               id;       // Which send it went out in
+	Segment            segment;  // NULL once the kernel is done with it
+	Segment            header;
+};
 
 struct senderSocket {
 	int                sockfd;
 	struct sockaddr_in serveraddr;
 	socklen_t          slen;
+	int                gsoSize;  // 0 if the kernel doesn't segment for us
+	
+	// Only used with zero-copy
+	int                zeroCopy;
+	Pool               headerPool;
+	struct zeroCopySend *pending;  // Circular, in order of id
+	uint               firstPending;
+	uint               numPending;
+	uint               maxPending;
+	uint               nextId;       // The kernel numbers sends from 0
+	uint               numZeroCopied;
+	uint               numCopied;    // Sends the kernel copied anyway
+	
+	// Only used with io_uring
+	Uring              ring;     // NULL if not using io_uring
+	Pool               pool;     // Its slabs are the registered buffers
+	int                receiving;     // A multishot receive is armed
+	int                closing;       // Don't arm the receive again
+	int                wakeArmed;     // A read of the wake fd is armed
+	unsigned long      wakeCount;
+	uint               sendsInFlight;
 };
 
+static int receiveReplies(SenderSocket ssock, Segment segments[], int n,
+                          int flags);
+static int takeGsoRun(SenderSocket ssock, Segment segments[], int n);
+static int countFrags(Segment s);
+static void disableSegmentOffload(SenderSocket ssock);
+static int fillIovecs(SenderSocket ssock, Segment s, Segment *header,
+                      struct iovec iovecs[]);
+static void addPending(SenderSocket ssock, uint id, Segment s,
+                       Segment header);
+static void reapZeroCopy(SenderSocket ssock, int wait);
+static void completeZeroCopy(SenderSocket ssock, uint first, uint last);
+static void registerSlab(void *arg, void *slab, unsigned long size);
+static void armReceive(SenderSocket ssock);
+static int reapCompletions(SenderSocket ssock, Segment segments[], int n,
+                           int *woken);
+
 SenderSocket newSocket(char *recvIp, int recvPort) {
 
 	SenderSocket ssock = calloc(1, sizeof(struct senderSocket));
@@ -53,7 +138,7 @@ void sendSocket(SenderSocket ssock, int length, Segment s) {
 
 int socketGetReply(SenderSocket ssock, Segment s) {
 	int recv_len;
-	if ((recv_len = recvfrom(ssock->sockfd, s, 100, 0,
+	if ((recv_len = recvfrom(ssock->sockfd, s, getHeaderSize(), 0,
 			(struct sockaddr *)  &(ssock->serveraddr),
 			&(ssock->slen))) < 0) {
 		errx(EXIT_FAILURE, "Failed to receive reply");
@@ -61,7 +146,541 @@ int socketGetReply(SenderSocket ssock, Segment s) {
 	return recv_len;
 }
 
+// Has the kernel split datagrams bigger than segmentSize into
+// segmentSize pieces (the last one can be smaller), so that a run of
+// full-sized segments can be handed over as one datagram. Returns 0
+// if the kernel can't do this.
+int enableSegmentOffload(SenderSocket ssock, int segmentSize) {
+	if (setsockopt(ssock->sockfd, IPPROTO_UDP, UDP_SEGMENT,
+			&segmentSize, sizeof(segmentSize)) < 0) {
+		return 0;
+	}
+	ssock->gsoSize = segmentSize;
+	return 1;
+}
+
+// With segmentation offload, each message is a run of segments that
+// the kernel will split back up at the right places. Without it, each
+// message is a single segment. With zero-copy, the socket holds on to
+// each segment until the kernel is done with it.
+void sendSocketBatch(SenderSocket ssock, Segment segments[], int n) {
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iovecs[2 * MAX_BATCH];
+	Segment headers[MAX_BATCH];
+	int firstSegment[MAX_BATCH + 1];
+	
+	if (ssock->numPending > 0) {
+		reapZeroCopy(ssock, 0);
+	}
+	
+	// If the kernel has had to copy every zero-copy send so far (as it
+	// does over loopback), pinning the pages only costs us, so stop
+	if (ssock->zeroCopy && ssock->numZeroCopied >= ZEROCOPY_PROBE &&
+			ssock->numCopied == ssock->numZeroCopied) {
+		ssock->zeroCopy = 0;
+		printf("The kernel copies zero-copy sends anyway, "
+		       "so they are copied from now on\n");
+	}
+	int flags = (ssock->zeroCopy ? MSG_ZEROCOPY : 0);
+	
+	while (n > 0) {
+		int count = (n < MAX_BATCH ? n : MAX_BATCH);
+		int nMsgs = 0;
+		int nIovecs = 0;
+		memset(msgs, 0, count * sizeof(struct mmsghdr));
+		for (int i = 0; i < count; nMsgs++) {
+			int runLength = takeGsoRun(ssock, segments + i, count - i);
+			msgs[nMsgs].msg_hdr.msg_iov = &iovecs[nIovecs];
+			for (int j = i; j < i + runLength; j++) {
+				nIovecs += fillIovecs(ssock, segments[j], &headers[j],
+				                      &iovecs[nIovecs]);
+			}
+			firstSegment[nMsgs] = i;
+			msgs[nMsgs].msg_hdr.msg_name = &(ssock->serveraddr);
+			msgs[nMsgs].msg_hdr.msg_namelen = sizeof(ssock->serveraddr);
+			msgs[nMsgs].msg_hdr.msg_iovlen =
+				&iovecs[nIovecs] - msgs[nMsgs].msg_hdr.msg_iov;
+			i += runLength;
+		}
+		firstSegment[nMsgs] = count;
+		
+		// sendmmsg can stop part way, so keep going from there. If the
+		// device turns out not to support segmentation offload, send
+		// the rest one segment at a time. If the kernel won't pin any
+		// more memory for zero-copy, wait for it to finish some sends.
+		int sent = 0;
+		while (sent < nMsgs) {
+			int r = sendmmsg(ssock->sockfd, msgs + sent, nMsgs - sent, flags);
+			if (r < 0 && errno == EIO && ssock->gsoSize > 0) {
+				disableSegmentOffload(ssock);
+				break;
+			} else if (r < 0 && errno == ENOBUFS && ssock->numPending > 0) {
+				reapZeroCopy(ssock, 1);
+				continue;
+			} else if (r < 0) {
+				errx(EXIT_FAILURE, "Failed to send segments");
+			}
+			
+			// Each message is a separate send as far as the kernel's
+			// numbering goes
+			for (int m = sent; ssock->zeroCopy && m < sent + r; m++) {
+				for (int j = firstSegment[m]; j < firstSegment[m + 1]; j++) {
+					addPending(ssock, ssock->nextId, segments[j], headers[j]);
+				}
+				ssock->nextId++;
+			}
+			sent += r;
+		}
+		
+		// The header copies of anything that wasn't sent are made again
+		if (sent < nMsgs) {
+			for (int j = firstSegment[sent]; ssock->zeroCopy && j < count; j++) {
+				freeSegment(headers[j]);
+			}
+			count = firstSegment[sent];
+		}
+		segments += count;
+		n -= count;
+	}
+}
+
+int socketGetReplies(SenderSocket ssock, Segment segments[], int n) {
+	int received = receiveReplies(ssock, segments, n, MSG_WAITFORONE);
+	if (received < 0) {
+		errx(EXIT_FAILURE, "Failed to receive replies");
+	}
+	return received;
+}
+
+int socketTryGetReplies(SenderSocket ssock, Segment segments[], int n) {
+	int received = receiveReplies(ssock, segments, n, MSG_DONTWAIT);
+	if (received < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		errx(EXIT_FAILURE, "Failed to receive replies");
+	}
+	return received;
+}
+
+int getSocketFd(SenderSocket ssock) {
+	return ssock->sockfd;
+}
+
 void closeSocket(SenderSocket ssock) {
 	close(ssock->sockfd);
 }
 
+// Receives up to n replies with one recvmmsg. Returns the number of
+// replies received, or -1 with errno set on error.
+static int receiveReplies(SenderSocket ssock, Segment segments[], int n,
+                          int flags) {
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iovecs[MAX_BATCH];
+	
+	if (n > MAX_BATCH) n = MAX_BATCH;
+	memset(msgs, 0, n * sizeof(struct mmsghdr));
+	for (int i = 0; i < n; i++) {
+		iovecs[i].iov_base = segments[i];
+		iovecs[i].iov_len = getHeaderSize();
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	return recvmmsg(ssock->sockfd, msgs, n, flags, NULL);
+}
+
+// Returns how many of the segments can go out as one datagram. Only
+// the last segment in a run can be shorter than the segment size.
+// With zero-copy, a run is also limited by how many fragments the
+// kernel can spread it over.
+static int takeGsoRun(SenderSocket ssock, Segment segments[], int n) {
+	if (ssock->gsoSize == 0) return 1;
+	
+	int runLength = 0;
+	int runBytes = 0;
+	int runFrags = 0;
+	while (runLength < n && runLength < MAX_GSO_SEGMENTS) {
+		int size = getHeaderSize() + getDataLength(segments[runLength]);
+		int frags = (ssock->zeroCopy ? countFrags(segments[runLength]) : 0);
+		if (runBytes + size > MAX_GSO_BYTES) break;
+		if (runLength > 0 && runFrags + frags > MAX_ZEROCOPY_FRAGS) break;
+		runBytes += size;
+		runFrags += frags;
+		runLength++;
+		if (size != ssock->gsoSize) break;
+	}
+	return runLength;
+}
+
+// Returns the most fragments a zero-copy send of the segment can take:
+// the pages its data spans, and up to two for its header copy
+static int countFrags(Segment s) {
+	unsigned long start = (unsigned long)getDataPortion(s);
+	unsigned long end = start + getDataLength(s);
+	if (end == start) return 2;
+	return 2 + (end - 1) / MIN_PAGE_SIZE - start / MIN_PAGE_SIZE + 1;
+}
+
+static void disableSegmentOffload(SenderSocket ssock) {
+	int off = 0;
+	setsockopt(ssock->sockfd, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof(off));
+	ssock->gsoSize = 0;
+	warnx("Segmentation offload failed, sending one segment at a time");
+}
+
+////////////////////////////////////////////////////////////////////////
+// Zero-copy
+
+// Segments are sent straight out of the sender window with
+// MSG_ZEROCOPY. The kernel reports which sends it is done with on the
+// socket's error queue, and the socket keeps its reference to each
+// segment until then, so a segment's slot can't be reused while the
+// kernel could still be reading it.
+int enableZeroCopy(SenderSocket ssock) {
+	int on = 1;
+	if (setsockopt(ssock->sockfd, SOL_SOCKET, SO_ZEROCOPY,
+			&on, sizeof(on)) < 0) {
+		return 0;
+	}
+	
+	ssock->headerPool = newSegmentPool(0, HEADERS_PER_SLAB);
+	ssock->zeroCopy = 1;
+	return 1;
+}
+
+void finishZeroCopy(SenderSocket ssock) {
+	if (ssock->headerPool == NULL) return;
+	
+	while (ssock->numPending > 0) {
+		uint before = ssock->numPending;
+		reapZeroCopy(ssock, 1);
+		if (ssock->numPending == before) {
+			warnx("Gave up waiting for %u zero-copy sends", before);
+			break;
+		}
+	}
+	printf("Zero-copy: %u sends, %u of them copied by the kernel anyway\n",
+	       ssock->numZeroCopied, ssock->numCopied);
+}
+
+// Fills in the iovecs to send the segment with, and returns how many
+// it took. A zero-copy send goes out from a copy of the header, which
+// is put in header. Otherwise the segment is sent as it is, from its
+// header and its data separately if it is a header copy.
+static int fillIovecs(SenderSocket ssock, Segment s, Segment *header,
+                      struct iovec iovecs[]) {
+	if (!ssock->zeroCopy && !isHeaderCopy(s)) {
+		iovecs[0].iov_base = s;
+		iovecs[0].iov_len = getHeaderSize() + getDataLength(s);
+		return 1;
+	}
+	
+	Segment from = s;
+	if (ssock->zeroCopy) {
+		*header = newEmptySegment(ssock->headerPool, 0);
+		memcpy(*header, s, getHeaderSize());
+		from = *header;
+	}
+	iovecs[0].iov_base = from;
+	iovecs[0].iov_len = getHeaderSize();
+	if (getDataLength(s) == 0) return 1;
+	
+	iovecs[1].iov_base = getDataPortion(s);
+	iovecs[1].iov_len = getDataLength(s);
+	return 2;
+}
+
+static void addPending(SenderSocket ssock, uint id, Segment s,
+                       Segment header) {
+	if (ssock->numPending == ssock->maxPending) {
+		uint max = (ssock->maxPending > 0 ? 2 * ssock->maxPending : 64);
+		struct zeroCopySend *pending = malloc(max * sizeof(*pending));
+		if (pending == NULL) {
+			errx(EXIT_FAILURE, "Insufficient memory! (addPending)");
+		}
+		for (uint i = 0; i < ssock->numPending; i++) {
+			pending[i] = ssock->pending[(ssock->firstPending + i) %
+			                            ssock->maxPending];
+		}
+		free(ssock->pending);
+		ssock->pending = pending;
+		ssock->firstPending = 0;
+		ssock->maxPending = max;
+	}
+	
+	struct zeroCopySend *zc = &(ssock->pending[(ssock->firstPending +
+	                            ssock->numPending) % ssock->maxPending]);
+	zc->id = id;
+	zc->segment = holdSegment(s);
+	zc->header = header;
+	ssock->numPending++;
+}
+
+// Handles the completions on the error queue. If wait is set, waits
+// (for a while) for there to be some first.
+static void reapZeroCopy(SenderSocket ssock, int wait) {
+	if (wait) {
+		struct pollfd pfd = { ssock->sockfd, 0, 0 };  // POLLERR is implied
+		poll(&pfd, 1, ZEROCOPY_WAIT);
+	}
+	
+	while (1) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(ssock->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			break;
+		}
+		
+		struct cmsghdr *cmsg;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+				continue;
+			}
+			struct sock_extended_err *ee = (void *)CMSG_DATA(cmsg);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			
+			// Sends ee_info to ee_data (inclusive) are done
+			uint numSends = ee->ee_data - ee->ee_info + 1;
+			ssock->numZeroCopied += numSends;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				ssock->numCopied += numSends;
+			}
+			completeZeroCopy(ssock, ee->ee_info, ee->ee_data);
+		}
+	}
+}
+
+// Releases the segments of sends first to last (inclusive), and drops
+// the finished sends from the front of the pending list. Ids wrap
+// around, so they are compared by their difference.
+static void completeZeroCopy(SenderSocket ssock, uint first, uint last) {
+	for (uint i = 0; i < ssock->numPending; i++) {
+		struct zeroCopySend *zc = &(ssock->pending[(ssock->firstPending + i) %
+		                                           ssock->maxPending]);
+		if ((int)(zc->id - first) < 0 || zc->segment == NULL) continue;
+		if ((int)(zc->id - last) > 0) break;
+		
+		freeSegment(zc->segment);
+		freeSegment(zc->header);
+		zc->segment = NULL;
+	}
+	
+	while (ssock->numPending > 0 &&
+			ssock->pending[ssock->firstPending].segment == NULL) {
+		ssock->firstPending = (ssock->firstPending + 1) % ssock->maxPending;
+		ssock->numPending--;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// io_uring
+
+// Replies are received by one multishot receive into provided
+// buffers, and copied out into the caller's segments. Segments from
+// the pool are sent straight out of registered buffers, which needs
+// the socket to be connected.
+int enableUring(SenderSocket ssock, Pool pool) {
+	Uring ring = newUring(URING_ENTRIES);
+	if (ring == NULL) return 0;
+	
+	if (registerBufferTable(ring, MAX_REGISTERED) < 0 ||
+			provideBuffers(ring, REPLY_GROUP, REPLY_BUFFERS,
+			               getHeaderSize()) < 0 ||
+			connect(ssock->sockfd, (struct sockaddr *)&(ssock->serveraddr),
+			        sizeof(ssock->serveraddr)) < 0) {
+		freeUring(ring);
+		return 0;
+	}
+	
+	ssock->ring = ring;
+	ssock->pool = pool;
+	ssock->closing = 0;
+	ssock->wakeArmed = 0;
+	ssock->sendsInFlight = 0;
+	setSlabHook(pool, registerSlab, ssock);
+	
+	armReceive(ssock);
+	if (submitUring(ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to submit to io_uring");
+	}
+	return 1;
+}
+
+// Cancels the receive (and any wait), and waits for every send to
+// complete, so that nothing is left that could take a reply
+void disableUring(SenderSocket ssock) {
+	if (ssock->ring == NULL) return;
+	
+	ssock->closing = 1;
+	uint64_t tags[] = { RECV_TAG, WAKE_TAG };
+	for (int i = 0; i < 2; i++) {
+		struct io_uring_sqe *sqe = getSqe(ssock->ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = tags[i];
+		sqe->user_data = CANCEL_TAG;
+	}
+	if (submitUring(ssock->ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to submit to io_uring");
+	}
+	
+	// Any replies that are still coming in are dropped
+	Segment s = newEmptySegment(NULL, 0);
+	int woken;
+	while (ssock->receiving || ssock->wakeArmed || ssock->sendsInFlight > 0) {
+		waitUring(ssock->ring, 1);
+		reapCompletions(ssock, &s, 1, &woken);
+	}
+	freeSegment(s);
+	
+	setSlabHook(ssock->pool, NULL, NULL);
+	freeUring(ssock->ring);
+	ssock->ring = NULL;
+}
+
+// A header copy goes out with a sendmsg from its header and its data.
+// The kernel copies the message in when it is submitted, so the
+// messages only have to last until then.
+void submitSegments(SenderSocket ssock, Segment segments[], int n) {
+	struct msghdr msgs[MAX_BATCH];
+	struct iovec iovecs[2 * MAX_BATCH];
+	int nMsgs = 0;
+	
+	for (int i = 0; i < n; i++) {
+		Segment s = segments[i];
+		if (isHeaderCopy(s) && nMsgs == MAX_BATCH) {
+			if (submitUring(ssock->ring) < 0) {
+				errx(EXIT_FAILURE, "Failed to send segments");
+			}
+			nMsgs = 0;
+		}
+		
+		struct io_uring_sqe *sqe = getSqe(ssock->ring);
+		sqe->fd = ssock->sockfd;
+		sqe->user_data = (uint64_t)(uintptr_t)s;
+		ssock->sendsInFlight++;
+		
+		if (isHeaderCopy(s)) {
+			struct msghdr *msg = &msgs[nMsgs];
+			memset(msg, 0, sizeof(*msg));
+			msg->msg_iov = &iovecs[2 * nMsgs];
+			msg->msg_iov[0].iov_base = s;
+			msg->msg_iov[0].iov_len = getHeaderSize();
+			msg->msg_iov[1].iov_base = getDataPortion(s);
+			msg->msg_iov[1].iov_len = getDataLength(s);
+			msg->msg_iovlen = 2;
+			nMsgs++;
+			
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->addr = (uint64_t)(uintptr_t)msg;
+			sqe->len = 1;
+			continue;
+		}
+		
+		uint length = getHeaderSize() + getDataLength(s);
+		int index = findRegisteredBuffer(ssock->ring, s, length);
+		if (index >= 0) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = index;
+		} else {
+			sqe->opcode = IORING_OP_SEND;
+		}
+		sqe->addr = (uint64_t)(uintptr_t)s;
+		sqe->len = length;
+	}
+	
+	if (submitUring(ssock->ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to send segments");
+	}
+}
+
+int awaitReplies(SenderSocket ssock, Segment segments[], int n, int wakeFd) {
+	if (wakeFd >= 0 && !ssock->wakeArmed) {
+		struct io_uring_sqe *sqe = getSqe(ssock->ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = wakeFd;
+		sqe->addr = (uint64_t)(uintptr_t)&(ssock->wakeCount);
+		sqe->len = sizeof(ssock->wakeCount);
+		sqe->user_data = WAKE_TAG;
+		ssock->wakeArmed = 1;
+	}
+	
+	int woken = 0;
+	int count = reapCompletions(ssock, segments, n, &woken);
+	while (wakeFd >= 0 && count == 0 && !woken) {
+		if (submitUring(ssock->ring) < 0 || waitUring(ssock->ring, 1) < 0) {
+			errx(EXIT_FAILURE, "Failed to wait on io_uring");
+		}
+		count = reapCompletions(ssock, segments, n, &woken);
+	}
+	
+	if (submitUring(ssock->ring) < 0) {
+		errx(EXIT_FAILURE, "Failed to submit to io_uring");
+	}
+	return count;
+}
+
+// Handles every completion that is ready, until n replies have been
+// received. Sent segments are freed, and the receive is armed again
+// if it has stopped (e.g. because it ran out of buffers).
+static int reapCompletions(SenderSocket ssock, Segment segments[], int n,
+                           int *woken) {
+	int count = 0;
+	struct io_uring_cqe *cqe;
+	
+	*woken = 0;
+	while (count < n && (cqe = peekCqe(ssock->ring)) != NULL) {
+		if (cqe->user_data == RECV_TAG) {
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				uint size = (cqe->res < getHeaderSize() ? cqe->res :
+				                                          getHeaderSize());
+				memcpy(segments[count++], getProvidedBuffer(ssock->ring, cqe),
+				       size);
+				recycleBuffer(ssock->ring, cqe);
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				ssock->receiving = 0;
+			}
+		
+		} else if (cqe->user_data == WAKE_TAG) {
+			ssock->wakeArmed = 0;
+			*woken = 1;
+		
+		} else if (cqe->user_data >= NUM_TAGS) {
+			// Without a listener, the receiver's port refuses
+			// datagrams, which is as good as them being lost
+			if (cqe->res < 0 && cqe->res != -ECONNREFUSED) {
+				errx(EXIT_FAILURE, "Failed to send segment");
+			}
+			freeSegment((Segment)(uintptr_t)cqe->user_data);
+			ssock->sendsInFlight--;
+		}
+		seenCqe(ssock->ring);
+	}
+	
+	if (!ssock->receiving && !ssock->closing) {
+		armReceive(ssock);
+	}
+	return count;
+}
+
+static void armReceive(SenderSocket ssock) {
+	struct io_uring_sqe *sqe = getSqe(ssock->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ssock->sockfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = REPLY_GROUP;
+	sqe->user_data = RECV_TAG;
+	ssock->receiving = 1;
+}
+
+// Called by the pool (with its lock held) for each of its slabs.
+// Segments in slabs that couldn't be registered go out with a send.
+static void registerSlab(void *arg, void *slab, unsigned long size) {
+	SenderSocket ssock = (SenderSocket)arg;
+	registerBuffer(ssock->ring, slab, size);
+}
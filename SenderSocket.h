@@ -13,5 +13,53 @@ void sendSocket(SenderSocket ssock, int length, Segment s);
 
 int socketGetReply(SenderSocket ssock, Segment s);
 
+// Lets the kernel split runs of segmentSize-byte segments up (GSO).
+// Returns 0 if it isn't supported.
+int enableSegmentOffload(SenderSocket ssock, int segmentSize);
+
+// Sends segments straight from their buffers (MSG_ZEROCOPY) from now
+// on, rather than having the kernel copy them. Returns 0 if it isn't
+// supported.
+int enableZeroCopy(SenderSocket ssock);
+
+// Waits for the kernel to finish with every zero-copy send
+void finishZeroCopy(SenderSocket ssock);
+
+// Sends n segments with as few system calls as possible. With
+// zero-copy, the socket holds on to the segments until the kernel is
+// done with them, so the caller can release them straight away.
+void sendSocketBatch(SenderSocket ssock, Segment segments[], int n);
+
+// Blocks until at least one reply arrives, then receives up to n
+// replies into the given segments in one go. Returns the number of
+// replies received.
+int socketGetReplies(SenderSocket ssock, Segment segments[], int n);
+
+// Like socketGetReplies, but returns 0 straight away if there are no
+// replies waiting
+int socketTryGetReplies(SenderSocket ssock, Segment segments[], int n);
+
+// Returns the socket's file descriptor, for polling
+int getSocketFd(SenderSocket ssock);
+
+// Sends and receives through io_uring from now on, with the slabs of
+// the given pool as registered buffers. The socket is connected to the
+// receiver. Returns 0 (and changes nothing) if io_uring isn't there.
+int enableUring(SenderSocket ssock, Pool pool);
+
+// Goes back to blocking calls once all of the sends have completed
+void disableUring(SenderSocket ssock);
+
+// Queues the segments to be sent through io_uring. The socket takes
+// over the caller's reference to each one, and frees it once it has
+// been sent.
+void submitSegments(SenderSocket ssock, Segment segments[], int n);
+
+// Receives up to n replies through io_uring into the given segments.
+// If wakeFd isn't -1, blocks until there is a reply or wakeFd can be
+// read; otherwise only takes the replies that are already in. Returns
+// the number of replies received.
+int awaitReplies(SenderSocket ssock, Segment segments[], int n, int wakeFd);
+
 void closeSocket(SenderSocket ssock);
 
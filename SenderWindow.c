@@ -4,7 +4,7 @@
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
 #include <err.h>
-#include <semaphore.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -14,6 +14,10 @@
 struct window {
 	uint     mws;
 	uint     mss;
+	uint     checksumType;  // Flag for the checksum agreed on
+	Pool     pool;          // Where data segments are allocated from
+	
+	uint     effectiveWindow;  // Bytes that may be in flight (at most MWS)
 	
 	uint     numOccupiedSpaces;
 	uint     numSpaces;
@@ -25,10 +29,16 @@ struct window {
 	uint     lastByteSent;
 	uint     nextSeqNo;
 	
-	sem_t    mutex;
+	pthread_mutex_t mutex;
+	pthread_cond_t  slid;   // Signalled whenever the window slides
 };
 
-SenderWindow newSenderWindow(uint mws, uint mss) {
+static Segment segmentAt(SenderWindow window, uint offset);
+static uint    findOffset(SenderWindow window, uint seqNo);
+static Segment insertSegment(SenderWindow window, uint length, char data[]);
+static int     hasSpaceFor(SenderWindow window, uint length);
+
+SenderWindow newSenderWindow(uint mws, uint mss, Pool pool) {
 	SenderWindow window = malloc(sizeof(struct window));
 	if (window == NULL) {
 		errx(EXIT_FAILURE, "Insufficient memory!");
@@ -36,6 +46,9 @@ SenderWindow newSenderWindow(uint mws, uint mss) {
 	
 	window->mws = mws;
 	window->mss = mss;
+	window->checksumType = 0;
+	window->pool = pool;
+	window->effectiveWindow = mws;
 	
 	window->numOccupiedSpaces = 0;
 	window->numSpaces = (mws >= mss ? mws / mss : 1);
@@ -47,15 +60,38 @@ SenderWindow newSenderWindow(uint mws, uint mss) {
 	window->lastByteSent = 0;
 	window->nextSeqNo    = 1;
 	
-	sem_init(&(window->mutex), 0, 1);
+	pthread_mutex_init(&(window->mutex), NULL);
+	pthread_cond_init(&(window->slid), NULL);
 	
 	return window;
 }
 
+// Sets the checksum type used for the data segments that
+// are buffered from now on
+void setChecksumType(SenderWindow window, uint type) {
+	window->checksumType = type;
+}
+
 uint getMws(SenderWindow window) {
 	return window->mws;
 }
 
+// Limits the number of bytes in flight to less than the MWS (e.g. to
+// the congestion window)
+void setEffectiveWindow(SenderWindow window, uint bytes) {
+	pthread_mutex_lock(&(window->mutex));
+	uint old = window->effectiveWindow;
+	window->effectiveWindow = (bytes < window->mws ? bytes : window->mws);
+	if (window->effectiveWindow > old) {
+		pthread_cond_broadcast(&(window->slid));
+	}
+	pthread_mutex_unlock(&(window->mutex));
+}
+
+uint getEffectiveWindow(SenderWindow window) {
+	return window->effectiveWindow;
+}
+
 uint getSendBase(SenderWindow window) {
 	return window->sendBase;
 }
@@ -72,93 +108,187 @@ void updateLastByteSent(SenderWindow window, Segment s) {
 	window->lastByteSent = getSeqNo(s) + getDataLength(s) - 1;
 }
 
-// Creates a segment from the given data and buffers it.
-// Also returns a copy of the segment so it can be transmitted.
+// Creates a segment from the given data and buffers it, sleeping
+// until the window slides if it is full.
+// Also returns another reference to the segment so it can be
+// transmitted. The caller must release it with freeSegment.
 Segment bufferData(SenderWindow window, int length, char data[]) {
+	pthread_mutex_lock(&(window->mutex));
 	
 	// Wait until there is window space available
-	while (window->numOccupiedSpaces == window->numSpaces);
+	while (!hasSpaceFor(window, length)) {
+		pthread_cond_wait(&(window->slid), &(window->mutex));
+	}
+	Segment s = insertSegment(window, length, data);
 	
-	sem_wait(&(window->mutex));
+	pthread_mutex_unlock(&(window->mutex));
+	return s;
+}
+
+// Like bufferData, but never waits. Buffers up to one MSS of the
+// data if there is window space available, and returns the number of
+// bytes that were accepted (0 if the window is full). If any were,
+// *s is set to a reference to the new segment, which the caller must
+// release with freeSegment.
+uint tryBufferData(SenderWindow window, uint length, char data[],
+                   Segment *s) {
+	uint accepted = 0;
+	*s = NULL;
 	
-	// Create a segment from the data and buffer it in the array
-	Segment s = newSegment(window->nextSeqNo, 1, window->mws, length,
-	                       0, data);
-	Segment copy = duplicateSegment(s);
-	window->nextSeqNo += length;
+	pthread_mutex_lock(&(window->mutex));
 	
-	// Figure out the index at which the new segment is inserted,
-	// and then insert the segment
-	int insertAt = (window->baseIndex + window->numOccupiedSpaces) %
-	               window->numSpaces;
-	freeSegment(window->buffer[insertAt]);
-	window->buffer[insertAt] = s;
-	window->numOccupiedSpaces++;
-	
-	sem_post(&(window->mutex));
+	uint wanted = (length < window->mss ? length : window->mss);
+	if (hasSpaceFor(window, wanted)) {
+		accepted = wanted;
+		*s = insertSegment(window, accepted, data);
+	}
 	
-	return copy;
+	pthread_mutex_unlock(&(window->mutex));
+	return accepted;
+}
+
+// Sleeps until every segment that has been buffered is acknowledged
+void waitUntilAllAcked(SenderWindow window) {
+	pthread_mutex_lock(&(window->mutex));
+	while (window->sendBase != window->nextSeqNo) {
+		pthread_cond_wait(&(window->slid), &(window->mutex));
+	}
+	pthread_mutex_unlock(&(window->mutex));
 }
 
 // Slide the window across in response to a new ACK received. Returns
 // Returns 1 if there are still any unacknowledged segments,
 // or 0 otherwise.
 int slideWindow(SenderWindow window, uint ackNo) {
-	sem_wait(&(window->mutex));
+	pthread_mutex_lock(&(window->mutex));
 	
 	// Update SendBase
 	window->sendBase = ackNo;
 	
-	// Find out how far to slide the window
-	int nSpacesFreed = 0;
-	for (int i = 0; i < window->numOccupiedSpaces; i++) {
+	// Find out how far to slide the window: every segment before
+	// the first one at or beyond ackNo has been acknowledged.
+	// Acknowledged segments are released here, but they are only
+	// returned to the pool once no in-flight send still holds them
+	uint nSpacesFreed = findOffset(window, ackNo);
+	for (uint i = 0; i < nSpacesFreed; i++) {
 		int index = (window->baseIndex + i) % window->numSpaces;
-		if (getSeqNo(window->buffer[index]) >= ackNo) break;
-		nSpacesFreed++;
+		freeSegment(window->buffer[index]);
+		window->buffer[index] = NULL;
 	}
 	window->baseIndex = (window->baseIndex + nSpacesFreed) % window->numSpaces;
 	window->numOccupiedSpaces -= nSpacesFreed;
 	
-	// Check if there are currently any not-yet-acknowledged segments
-	int result = 0;
-	for (int i = 0; i < window->numOccupiedSpaces; i++) {
-		int index = (window->baseIndex + i) % window->numSpaces;
-		if (getSeqNo(window->buffer[index]) >= ackNo) {
-			result = 1; break;
-		}
-	}
+	// Wake up anyone waiting for space, or for everything to be
+	// acknowledged
+	pthread_cond_broadcast(&(window->slid));
+	
+	// Whatever is left in the window has not been acknowledged
+	int result = (window->numOccupiedSpaces > 0);
 	
-	sem_post(&(window->mutex));
+	pthread_mutex_unlock(&(window->mutex));
 	return result;
 }
 
-// Returns a copy of the segment with sequence no. equal to seqNo. It
-// is invalid to give this function a sequence no. that is not
-// currently covered by the window.
+// Returns a reference to the segment with sequence no. equal to seqNo,
+// or NULL if it is not in the window. The caller must release it with
+// freeSegment.
 Segment getSegment(SenderWindow window, uint seqNo) {
-	sem_wait(&(window->mutex));
+	pthread_mutex_lock(&(window->mutex));
 	
 	Segment s = NULL;
 	
-	for (int i = 0; i < window->numOccupiedSpaces; i++) {
-		int index = (window->baseIndex + i) % window->numSpaces;
-		if (getSeqNo(window->buffer[index]) == seqNo) {
-			s = duplicateSegment(window->buffer[index]);
-			break;
-		}
+	uint offset = findOffset(window, seqNo);
+	if (offset < window->numOccupiedSpaces &&
+			getSeqNo(segmentAt(window, offset)) == seqNo) {
+		s = holdSegment(segmentAt(window, offset));
 	}
 	
-	sem_post(&(window->mutex));
+	pthread_mutex_unlock(&(window->mutex));
 	return s;
 }
 
-// Returns a copy of the segment with sequence no. equal to sendBase
+// Returns a reference to the segment with sequence no. equal to
+// sendBase, or NULL if every segment has been acknowledged
 Segment getBaseSegment(SenderWindow window) {
-	sem_wait(&(window->mutex));
+	pthread_mutex_lock(&(window->mutex));
 	
-	Segment s = duplicateSegment(window->buffer[window->baseIndex]);
+	Segment s = NULL;
+	if (window->numOccupiedSpaces > 0) {
+		s = holdSegment(window->buffer[window->baseIndex]);
+	}
 	
-	sem_post(&(window->mutex));
+	pthread_mutex_unlock(&(window->mutex));
 	return s;
 }
 
+// Returns 1 if a segment with length bytes of data can be buffered
+// without going over the effective window. There is always space for
+// one segment if nothing is in flight. Must be called with the mutex
+// held.
+static int hasSpaceFor(SenderWindow window, uint length) {
+	if (window->numOccupiedSpaces == window->numSpaces) {
+		return 0;
+	}
+	uint inFlight = window->nextSeqNo - window->sendBase;
+	return (window->numOccupiedSpaces == 0 ||
+	        inFlight + length <= window->effectiveWindow);
+}
+
+// Creates a segment from the given data and inserts it at the end of
+// the window. Returns another reference to the segment. Must be
+// called with the mutex held, and with space in the window.
+static Segment insertSegment(SenderWindow window, uint length, char data[]) {
+	Segment s = newPooledSegment(window->pool, window->nextSeqNo, 1,
+	                             window->mws, length,
+	                             window->checksumType, data);
+	window->nextSeqNo += length;
+	
+	// Figure out the index at which the new segment is inserted,
+	// and then insert the segment
+	int insertAt = (window->baseIndex + window->numOccupiedSpaces) %
+	               window->numSpaces;
+	window->buffer[insertAt] = s;
+	window->numOccupiedSpaces++;
+	
+	return holdSegment(s);
+}
+
+// Returns the segment that is offset places after the base of the
+// window. Must be called with the mutex held.
+static Segment segmentAt(SenderWindow window, uint offset) {
+	return window->buffer[(window->baseIndex + offset) % window->numSpaces];
+}
+
+// Returns the offset from the base of the window of the first segment
+// with a sequence no. of at least seqNo, or numOccupiedSpaces if there
+// is no such segment. Must be called with the mutex held.
+// Every segment but the last one is normally MSS bytes long, so the
+// offset can usually be worked out directly from the sequence no.
+// Otherwise, fall back to a binary search, since the segments in the
+// window are in order.
+static uint findOffset(SenderWindow window, uint seqNo) {
+	uint n = window->numOccupiedSpaces;
+	if (n == 0 || seqNo <= getSeqNo(segmentAt(window, 0))) {
+		return 0;
+	}
+	
+	uint guess = (seqNo - getSeqNo(segmentAt(window, 0)) +
+	              window->mss - 1) / window->mss;
+	if (guess <= n && getSeqNo(segmentAt(window, guess - 1)) < seqNo &&
+			(guess == n || getSeqNo(segmentAt(window, guess)) >= seqNo)) {
+		return guess;
+	}
+	
+	uint lo = 0;
+	uint hi = n;
+	while (lo < hi) {
+		uint mid = lo + (hi - lo) / 2;
+		if (getSeqNo(segmentAt(window, mid)) < seqNo) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
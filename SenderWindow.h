@@ -12,10 +12,16 @@ typedef struct window *SenderWindow;
 
 typedef unsigned int uint;
 
-SenderWindow newSenderWindow(uint mws, uint mss);
+SenderWindow newSenderWindow(uint mws, uint mss, Pool pool);
+
+void setChecksumType(SenderWindow window, uint type);
 
 uint getMws(SenderWindow window);
 
+void setEffectiveWindow(SenderWindow window, uint bytes);
+
+uint getEffectiveWindow(SenderWindow window);
+
 uint getSendBase(SenderWindow window);
 
 uint getLastByteSent(SenderWindow window);
@@ -26,6 +32,11 @@ void updateLastByteSent(SenderWindow window, Segment s);
 
 Segment bufferData(SenderWindow window, int length, char data[]);
 
+uint tryBufferData(SenderWindow window, uint length, char data[],
+                   Segment *s);
+
+void waitUntilAllAcked(SenderWindow window);
+
 int slideWindow(SenderWindow window, uint ackNo);
 
 Segment getSegment(SenderWindow window, uint ackNo);
@@ -1,14 +1,14 @@
 // Timer.c
 // Implementation of the Timer ADT
-// Maintains the RTO, calculates the sample RTT and updates
-// the RTO interval
+// Calculates the sample RTT and updates the RTO interval.
+// The RTO itself is run on a TimerWheel.
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
 #include <err.h>
+#include <limits.h>
 #include <math.h>
 #include <semaphore.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -23,6 +23,7 @@ struct timer {
 	double timeOutInterval;
 	double estimatedRTT;
 	double devRTT;
+	uint   numSamples;
 	
 	struct timeval start;
 	uint           sampledSeqNo; // Sequence no. of the segment we're using
@@ -31,16 +32,13 @@ struct timer {
 	                             // expecting back.
 	uint           isSampling;   // Indicates whether we are timing the RTT
 	                             // of a segment at the moment (or not)
+	struct timespec created;     // Timestamps count microseconds from here
 	sem_t          lock;
 };
 
 static void updateTimeOutInterval(Timer timer, double sampleRTT);
 static double timeDiff(struct timeval t0, struct timeval t1);
 
-static void wakeUp(int sigID) {
-	// Do nothing
-}
-
 Timer newTimer(uint gamma) {
 	Timer timer = malloc(sizeof(struct timer));
 	if (timer == NULL) {
@@ -50,35 +48,28 @@ Timer newTimer(uint gamma) {
 	timer->gamma = gamma;
 	timer->estimatedRTT = 0.50;
 	timer->devRTT = 0.25;
+	timer->numSamples = 0;
 	timer->timeOutInterval = timer->estimatedRTT + timer->gamma * timer->devRTT;
 	
 	timer->isSampling = 0;
+	clock_gettime(CLOCK_MONOTONIC, &(timer->created));
 	sem_init(&(timer->lock), 0, 1);
 	
-	if (signal(SIGALRM, wakeUp) == SIG_ERR) {
-		errx(EXIT_FAILURE, "Can't set signal handler\n");
-	}
-	
 	return timer;
 }
 
-double startTimer(Timer timer) {
-	int intPart = (int)(timer->timeOutInterval);
-	int decPart = 1000000000 * (timer->timeOutInterval - intPart);
-	struct timespec duration = {intPart, decPart};
-	struct timespec remaining;
-	
-	int e = nanosleep(&duration, &remaining);
-	double timeRemaining = (e == 0) ? 0 : (remaining.tv_sec * 1.0 +
-	                       remaining.tv_nsec / 1000000000.0);
-	
-	return timeRemaining;
-}
-
 double getTimeOutInterval(Timer timer) {
 	return timer->timeOutInterval;
 }
 
+// Returns the smoothed RTT, or 0 if the RTT hasn't been sampled yet
+double getSmoothedRTT(Timer timer) {
+	sem_wait(&(timer->lock));
+	double srtt = (timer->numSamples > 0 ? timer->estimatedRTT : 0);
+	sem_post(&(timer->lock));
+	return srtt;
+}
+
 uint getSampledSeqNo(Timer timer) {
 	return timer->sampledSeqNo;
 }
@@ -104,7 +95,8 @@ int isSamplingRTT(Timer timer) {
 	return result;
 }
 
-void stopSamplingRTT(Timer timer) {
+// Returns the sample RTT
+double stopSamplingRTT(Timer timer) {
 	sem_wait(&(timer->lock));
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -112,11 +104,20 @@ void stopSamplingRTT(Timer timer) {
 	updateTimeOutInterval(timer, sampleRTT);
 	timer->isSampling = 0;
 	sem_post(&(timer->lock));
+	return sampleRTT;
 }
 
 static void updateTimeOutInterval(Timer timer, double sampleRTT) {
-	timer->estimatedRTT = (0.875 * timer->estimatedRTT) + (0.125 * sampleRTT);
-	timer->devRTT = (0.75 * timer->devRTT) + (0.25 * fabs(sampleRTT - timer->estimatedRTT));
+	// The first sample replaces the initial guesses outright
+	// (RFC 6298), so the smoothed RTT doesn't take dozens of samples
+	// to come down from 0.5s
+	if (timer->numSamples++ == 0) {
+		timer->estimatedRTT = sampleRTT;
+		timer->devRTT = sampleRTT / 2;
+	} else {
+		timer->estimatedRTT = (0.875 * timer->estimatedRTT) + (0.125 * sampleRTT);
+		timer->devRTT = (0.75 * timer->devRTT) + (0.25 * fabs(sampleRTT - timer->estimatedRTT));
+	}
 	timer->timeOutInterval = timer->estimatedRTT + timer->gamma * timer->devRTT;
 	
 	if (timer->timeOutInterval < 0.1)
@@ -128,6 +129,36 @@ static void updateTimeOutInterval(Timer timer, double sampleRTT) {
 	//	timer->timeOutInterval = 1.0;
 }
 
+// Returns a timestamp to stamp a segment with, in microseconds since
+// the timer was created. Timestamps wrap around (about every 71
+// minutes), and skip NO_TIMESTAMP when they do, so they count from
+// 1 up to UINT_MAX and then start again at 1.
+uint getTimestamp(Timer timer) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long us =
+		(now.tv_sec - timer->created.tv_sec) * 1000000ULL +
+		(now.tv_nsec - timer->created.tv_nsec) / 1000;
+	return (uint)(us % UINT_MAX) + 1;
+}
+
+// Takes a sample of the RTT from a timestamp echoed back in an ACK.
+// Returns the sample RTT, or 0 if the timestamp was no good.
+// Timestamps wrap around, so they are compared by their difference,
+// which is off by a microsecond for a sample that spans the wrap.
+double sampleEchoedRTT(Timer timer, uint tsEcr) {
+	int elapsed = (int)(getTimestamp(timer) - tsEcr);
+	
+	// Ignore anything we couldn't have sent yet
+	if (tsEcr == NO_TIMESTAMP || elapsed < 0) return 0;
+	
+	double sampleRTT = elapsed / 1000000.0;
+	sem_wait(&(timer->lock));
+	updateTimeOutInterval(timer, sampleRTT);
+	sem_post(&(timer->lock));
+	return sampleRTT;
+}
+
 void cancelSamplingRTT(Timer timer) {
 	sem_wait(&(timer->lock));
 	timer->isSampling = 0;
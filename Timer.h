@@ -14,10 +14,10 @@ typedef unsigned int uint;
 
 Timer newTimer(uint gamma);
 
-double startTimer(Timer timer);
-
 double getTimeOutInterval(Timer timer);
 
+double getSmoothedRTT(Timer timer);
+
 uint getSampledSeqNo(Timer timer);
 
 uint getSampledAckNo(Timer timer);
@@ -26,9 +26,13 @@ void startSamplingRTT(Timer timer, Segment s);
 
 int isSamplingRTT(Timer timer);
 
-void stopSamplingRTT(Timer timer);
+double stopSamplingRTT(Timer timer);
 
 void cancelSamplingRTT(Timer timer);
 
+uint getTimestamp(Timer timer);
+
+double sampleEchoedRTT(Timer timer, uint tsEcr);
+
 #endif
 
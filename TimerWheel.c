@@ -0,0 +1,458 @@
+// TimerWheel.c
+// Implementation of the TimerWheel ADT
+// Timers hang off a hierarchy of wheels of 64 slots each. The first
+// wheel has a slot per tick, and each wheel after that has slots 64
+// times as wide as the one before. When the first wheel wraps around,
+// the next slot of the wheel above is cascaded down into it, so arming
+// and cancelling a timer is only ever a list insertion or removal.
+// The wheel's thread sleeps on a timerfd, which is set for the next
+// tick at which anything could expire rather than for every tick.
+// An event loop can take the wheel over instead, by waiting on the
+// timerfd itself and running the wheel whenever it goes off.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "TimerWheel.h"
+
+#define LEVEL_BITS      6
+#define SLOTS_PER_LEVEL (1 << LEVEL_BITS)
+#define SLOT_MASK       (SLOTS_PER_LEVEL - 1)
+#define NUM_LEVELS      4
+
+// Timers further away than this are clamped to it
+#define MAX_DELTA       (((uint64_t)1 << (LEVEL_BITS * NUM_LEVELS)) - 1)
+
+#define NO_WAKEUP       UINT64_MAX
+#define NS_PER_SEC      1000000000ULL
+
+enum timerState { IDLE, PENDING, EXPIRED };
+
+struct wheelTimer {
+	TimerWheel          wheel;
+	TimerCallback       callback;
+	void               *arg;
+	int                 oneShot;  // Freed by the wheel once it has run
+	
+	enum timerState     state;
+	uint64_t            expires;  // Tick at which the timer expires
+	uint                level;
+	struct wheelTimer  *next;
+	struct wheelTimer **pprev;    // The pointer that points to this timer
+};
+
+struct timerWheel {
+	uint64_t            tickNs;
+	uint64_t            originNs;    // When tick 0 started
+	uint64_t            tick;        // Next tick to be processed
+	uint64_t            wakeupTick;  // Tick the timerfd is set for
+	
+	struct wheelTimer  *slots[NUM_LEVELS][SLOTS_PER_LEVEL];
+	uint                numPending[NUM_LEVELS];
+	struct wheelTimer  *expired;     // Timers whose callbacks are due
+	
+	int                 timerFd;
+	int                 stopping;
+	int                 hasThread;   // 0 once an event loop takes over
+	pthread_t           thread;
+	pthread_mutex_t     lock;
+};
+
+static void    *runWheel(void *arg);
+static void     stopThread(TimerWheel wheel);
+static void     catchUp(TimerWheel wheel);
+static void     processTick(TimerWheel wheel);
+static void     runExpired(TimerWheel wheel);
+static void     cascade(TimerWheel wheel, uint level, uint slot);
+static void     armLocked(WheelTimer timer, double seconds);
+static void     disarmLocked(WheelTimer timer);
+static void     placeTimer(TimerWheel wheel, WheelTimer timer);
+static uint64_t nextWakeup(TimerWheel wheel);
+static void     setWakeup(TimerWheel wheel, uint64_t tick);
+static void     linkTimer(struct wheelTimer **head, WheelTimer timer);
+static void     unlinkTimer(WheelTimer timer);
+static uint64_t nowNs(void);
+
+TimerWheel newTimerWheel(uint tickMs) {
+	TimerWheel wheel = calloc(1, sizeof(struct timerWheel));
+	if (wheel == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newTimerWheel)");
+	}
+	
+	wheel->tickNs = (uint64_t)(tickMs > 0 ? tickMs : 1) * 1000000;
+	wheel->originNs = nowNs();
+	wheel->tick = 0;
+	wheel->wakeupTick = NO_WAKEUP;
+	wheel->expired = NULL;
+	wheel->stopping = 0;
+	
+	wheel->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (wheel->timerFd < 0) {
+		errx(EXIT_FAILURE, "timerfd_create() failed (newTimerWheel)");
+	}
+	
+	pthread_mutex_init(&(wheel->lock), NULL);
+	wheel->hasThread = 1;
+	pthread_create(&(wheel->thread), NULL, runWheel, wheel);
+	
+	return wheel;
+}
+
+void freeTimerWheel(TimerWheel wheel) {
+	stopTimerWheel(wheel);
+	
+	// Timers that belong to the wheel go with it, and the rest are
+	// left for their owners to free
+	for (uint level = 0; level < NUM_LEVELS; level++) {
+		for (uint slot = 0; slot < SLOTS_PER_LEVEL; slot++) {
+			while (wheel->slots[level][slot] != NULL) {
+				WheelTimer timer = wheel->slots[level][slot];
+				disarmLocked(timer);
+				if (timer->oneShot) free(timer);
+			}
+		}
+	}
+	while (wheel->expired != NULL) {
+		WheelTimer timer = wheel->expired;
+		disarmLocked(timer);
+		if (timer->oneShot) free(timer);
+	}
+	
+	close(wheel->timerFd);
+	pthread_mutex_destroy(&(wheel->lock));
+	free(wheel);
+}
+
+void stopTimerWheel(TimerWheel wheel) {
+	if (wheel->hasThread) {
+		stopThread(wheel);
+		wheel->hasThread = 0;
+	}
+}
+
+WheelTimer newWheelTimer(TimerWheel wheel, TimerCallback callback, void *arg) {
+	WheelTimer timer = calloc(1, sizeof(struct wheelTimer));
+	if (timer == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newWheelTimer)");
+	}
+	
+	timer->wheel = wheel;
+	timer->callback = callback;
+	timer->arg = arg;
+	timer->oneShot = 0;
+	timer->state = IDLE;
+	return timer;
+}
+
+void freeWheelTimer(WheelTimer timer) {
+	cancelTimer(timer);
+	free(timer);
+}
+
+void armTimer(WheelTimer timer, double seconds) {
+	pthread_mutex_lock(&(timer->wheel->lock));
+	disarmLocked(timer);
+	armLocked(timer, seconds);
+	pthread_mutex_unlock(&(timer->wheel->lock));
+}
+
+int armTimerIfIdle(WheelTimer timer, double seconds) {
+	int armed = 0;
+	
+	pthread_mutex_lock(&(timer->wheel->lock));
+	if (timer->state == IDLE) {
+		armLocked(timer, seconds);
+		armed = 1;
+	}
+	pthread_mutex_unlock(&(timer->wheel->lock));
+	
+	return armed;
+}
+
+void cancelTimer(WheelTimer timer) {
+	pthread_mutex_lock(&(timer->wheel->lock));
+	disarmLocked(timer);
+	pthread_mutex_unlock(&(timer->wheel->lock));
+}
+
+int timerIsArmed(WheelTimer timer) {
+	pthread_mutex_lock(&(timer->wheel->lock));
+	int armed = (timer->state != IDLE);
+	pthread_mutex_unlock(&(timer->wheel->lock));
+	return armed;
+}
+
+void runAfter(TimerWheel wheel, double seconds, TimerCallback callback,
+              void *arg) {
+	WheelTimer timer = newWheelTimer(wheel, callback, arg);
+	timer->oneShot = 1;
+	armTimer(timer, seconds);
+}
+
+// The timerfd is made non-blocking, since arming a timer can reset it
+// between the event loop seeing it go off and runTimerWheel reading it
+int takeOverTimerWheel(TimerWheel wheel) {
+	if (wheel->hasThread) {
+		stopThread(wheel);
+		wheel->stopping = 0;
+		wheel->hasThread = 0;
+		
+		int flags = fcntl(wheel->timerFd, F_GETFL);
+		fcntl(wheel->timerFd, F_SETFL, flags | O_NONBLOCK);
+		
+		pthread_mutex_lock(&(wheel->lock));
+		setWakeup(wheel, nextWakeup(wheel));
+		pthread_mutex_unlock(&(wheel->lock));
+	}
+	return wheel->timerFd;
+}
+
+void runTimerWheel(TimerWheel wheel) {
+	uint64_t expirations;
+	if (read(wheel->timerFd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN) {
+		// EAGAIN just means the timerfd was reset in the meantime
+		errx(EXIT_FAILURE, "Failed to read the timer wheel");
+	}
+	
+	pthread_mutex_lock(&(wheel->lock));
+	catchUp(wheel);
+	setWakeup(wheel, nextWakeup(wheel));
+	pthread_mutex_unlock(&(wheel->lock));
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// Thread that runs the wheel
+// Catches up on every tick that has gone by since it last woke up,
+// then goes back to sleep until the next tick that matters
+static void *runWheel(void *arg) {
+	TimerWheel wheel = (TimerWheel)arg;
+	
+	pthread_mutex_lock(&(wheel->lock));
+	while (!wheel->stopping) {
+		catchUp(wheel);
+		if (wheel->stopping) break;
+		
+		setWakeup(wheel, nextWakeup(wheel));
+		pthread_mutex_unlock(&(wheel->lock));
+		
+		uint64_t expirations;
+		if (read(wheel->timerFd, &expirations, sizeof(expirations)) < 0) {
+			errx(EXIT_FAILURE, "Failed to wait on the timer wheel");
+		}
+		
+		pthread_mutex_lock(&(wheel->lock));
+	}
+	pthread_mutex_unlock(&(wheel->lock));
+	
+	return NULL;
+}
+
+static void stopThread(TimerWheel wheel) {
+	pthread_mutex_lock(&(wheel->lock));
+	wheel->stopping = 1;
+	setWakeup(wheel, 0);
+	pthread_mutex_unlock(&(wheel->lock));
+	pthread_join(wheel->thread, NULL);
+}
+
+// Processes every tick up to now, running the callbacks of whatever
+// expires. Must be called with the lock held.
+static void catchUp(TimerWheel wheel) {
+	wheel->wakeupTick = NO_WAKEUP;
+	
+	uint64_t now = (nowNs() - wheel->originNs) / wheel->tickNs;
+	while (wheel->tick <= now && !wheel->stopping) {
+		processTick(wheel);
+		runExpired(wheel);
+	}
+}
+
+// Processes the next tick: moves anything that is due onto the
+// expired list. Must be called with the lock held.
+static void processTick(TimerWheel wheel) {
+	uint64_t tick = wheel->tick;
+	
+	// When the first wheel wraps around, cascade the next slot of each
+	// wheel above it that has also wrapped around
+	if ((tick & SLOT_MASK) == 0) {
+		for (uint level = 1; level < NUM_LEVELS; level++) {
+			uint slot = (tick >> (LEVEL_BITS * level)) & SLOT_MASK;
+			cascade(wheel, level, slot);
+			if (slot != 0) break;
+		}
+	}
+	
+	struct wheelTimer **head = &(wheel->slots[0][tick & SLOT_MASK]);
+	while (*head != NULL) {
+		WheelTimer timer = *head;
+		unlinkTimer(timer);
+		wheel->numPending[0]--;
+		timer->state = EXPIRED;
+		linkTimer(&(wheel->expired), timer);
+	}
+	
+	wheel->tick++;
+}
+
+// Runs the callbacks of expired timers one at a time, without the
+// lock held, so that callbacks can arm and cancel timers themselves.
+// A timer that is cancelled before its turn comes is not run.
+// Must be called with the lock held.
+static void runExpired(TimerWheel wheel) {
+	while (wheel->expired != NULL) {
+		WheelTimer timer = wheel->expired;
+		unlinkTimer(timer);
+		timer->state = IDLE;
+		
+		// The callback might free the timer if it owns it
+		int oneShot = timer->oneShot;
+		pthread_mutex_unlock(&(wheel->lock));
+		timer->callback(timer->arg);
+		if (oneShot) free(timer);
+		pthread_mutex_lock(&(wheel->lock));
+	}
+}
+
+// Moves every timer in a slot down to the wheel that now covers it
+static void cascade(TimerWheel wheel, uint level, uint slot) {
+	WheelTimer timer = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+	
+	while (timer != NULL) {
+		WheelTimer next = timer->next;
+		wheel->numPending[level]--;
+		placeTimer(wheel, timer);
+		timer = next;
+	}
+}
+
+// Must be called with the lock held, and with the timer idle
+static void armLocked(WheelTimer timer, double seconds) {
+	TimerWheel wheel = timer->wheel;
+	
+	// Nothing is pending, so the wheel can skip straight to now
+	// rather than catching up on ticks in which nothing happens
+	uint64_t now = nowNs() - wheel->originNs;
+	if (wheel->numPending[0] + wheel->numPending[1] +
+			wheel->numPending[2] + wheel->numPending[3] == 0 &&
+			now / wheel->tickNs > wheel->tick) {
+		wheel->tick = now / wheel->tickNs;
+	}
+	
+	// Round up, so the timer never expires early
+	uint64_t delay = (seconds > 0 ? (uint64_t)(seconds * NS_PER_SEC) : 0);
+	timer->expires = (now + delay + wheel->tickNs - 1) / wheel->tickNs;
+	placeTimer(wheel, timer);
+	
+	if (timer->expires < wheel->wakeupTick) {
+		setWakeup(wheel, timer->expires);
+	}
+}
+
+// Takes the timer off the wheel or the expired list (if it is on
+// either). Must be called with the lock held.
+static void disarmLocked(WheelTimer timer) {
+	if (timer->state == PENDING) {
+		timer->wheel->numPending[timer->level]--;
+		unlinkTimer(timer);
+	} else if (timer->state == EXPIRED) {
+		unlinkTimer(timer);
+	}
+	timer->state = IDLE;
+}
+
+// Puts the timer in the slot that covers its expiry, on the lowest
+// wheel that reaches that far ahead
+static void placeTimer(TimerWheel wheel, WheelTimer timer) {
+	if (timer->expires < wheel->tick) {
+		timer->expires = wheel->tick;
+	} else if (timer->expires - wheel->tick > MAX_DELTA) {
+		timer->expires = wheel->tick + MAX_DELTA;
+	}
+	
+	uint64_t delta = timer->expires - wheel->tick;
+	uint level = 0;
+	while (level < NUM_LEVELS - 1 &&
+			delta >= ((uint64_t)1 << (LEVEL_BITS * (level + 1)))) {
+		level++;
+	}
+	
+	uint slot = (timer->expires >> (LEVEL_BITS * level)) & SLOT_MASK;
+	linkTimer(&(wheel->slots[level][slot]), timer);
+	wheel->numPending[level]++;
+	timer->level = level;
+	timer->state = PENDING;
+}
+
+// Returns the next tick at which a timer could expire or has to be
+// cascaded, or NO_WAKEUP if no timers are pending
+static uint64_t nextWakeup(TimerWheel wheel) {
+	uint64_t next = NO_WAKEUP;
+	
+	if (wheel->numPending[0] > 0) {
+		for (uint i = 0; i < SLOTS_PER_LEVEL; i++) {
+			if (wheel->slots[0][(wheel->tick + i) & SLOT_MASK] != NULL) {
+				next = wheel->tick + i;
+				break;
+			}
+		}
+	}
+	
+	if (wheel->numPending[1] + wheel->numPending[2] +
+			wheel->numPending[3] > 0) {
+		uint64_t wrap = (wheel->tick + SLOT_MASK) & ~(uint64_t)SLOT_MASK;
+		if (wrap < next) next = wrap;
+	}
+	
+	return next;
+}
+
+// Sets the timerfd to go off at the start of the given tick
+static void setWakeup(TimerWheel wheel, uint64_t tick) {
+	struct itimerspec when = {{0, 0}, {0, 0}};
+	if (tick != NO_WAKEUP) {
+		// A zero it_value would disarm the timer
+		uint64_t ns = wheel->originNs + tick * wheel->tickNs;
+		when.it_value.tv_sec = ns / NS_PER_SEC;
+		when.it_value.tv_nsec = (ns % NS_PER_SEC) + (ns == 0);
+	}
+	
+	timerfd_settime(wheel->timerFd, TFD_TIMER_ABSTIME, &when, NULL);
+	wheel->wakeupTick = tick;
+}
+
+static void linkTimer(struct wheelTimer **head, WheelTimer timer) {
+	timer->next = *head;
+	if (timer->next != NULL) {
+		timer->next->pprev = &(timer->next);
+	}
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void unlinkTimer(WheelTimer timer) {
+	*(timer->pprev) = timer->next;
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static uint64_t nowNs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
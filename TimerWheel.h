@@ -0,0 +1,62 @@
+// TimerWheel.h
+// Header file for the TimerWheel ADT
+// A timer wheel runs callbacks after a given amount of time. Any
+// number of timers can be armed, re-armed and cancelled in O(1).
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+typedef struct timerWheel *TimerWheel;
+
+typedef struct wheelTimer *WheelTimer;
+
+typedef unsigned int uint;
+
+// Callbacks are run one at a time on the wheel's own thread (or on the
+// event loop's, once it has taken the wheel over)
+typedef void (*TimerCallback)(void *arg);
+
+// Starts a wheel that keeps time in ticks of tickMs milliseconds
+TimerWheel newTimerWheel(uint tickMs);
+
+// Stops the wheel. Timers that have not expired yet never will.
+void freeTimerWheel(TimerWheel wheel);
+
+// Stops the wheel's own thread without freeing the wheel. Once this
+// returns, no callback is running or will run again, so the timers
+// can be freed safely.
+void stopTimerWheel(TimerWheel wheel);
+
+WheelTimer newWheelTimer(TimerWheel wheel, TimerCallback callback, void *arg);
+
+void freeWheelTimer(WheelTimer timer);
+
+// Arms the timer to expire after the given number of seconds,
+// replacing any expiry it already had
+void armTimer(WheelTimer timer, double seconds);
+
+// Arms the timer only if it is not already armed. Returns 1 if the
+// timer was armed by this call, or 0 otherwise.
+int armTimerIfIdle(WheelTimer timer, double seconds);
+
+// Once this returns, the callback will not be run until the timer is
+// armed again (but it may be running right now)
+void cancelTimer(WheelTimer timer);
+
+int timerIsArmed(WheelTimer timer);
+
+// Runs the callback once after the given number of seconds
+void runAfter(TimerWheel wheel, double seconds, TimerCallback callback,
+              void *arg);
+
+// Stops the wheel's own thread, so that an event loop can run the
+// wheel instead. Returns a file descriptor that becomes readable when
+// something is due, at which point the loop should call runTimerWheel.
+int takeOverTimerWheel(TimerWheel wheel);
+
+// Runs the callbacks of every timer that is due, on the calling thread
+void runTimerWheel(TimerWheel wheel);
+
+#endif
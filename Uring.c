@@ -0,0 +1,338 @@
+// Uring.c
+// Implementation of the Uring ADT
+// The rings are shared with the kernel. We own the submission queue
+// tail and the completion queue head, and the kernel owns the other
+// ends, so each side publishes its end with a release store and reads
+// the other side's with an acquire load. Nothing here is thread-safe:
+// callers that share a ring between threads have to lock around it.
+// The one exception is the table of registered buffers, which one
+// thread can add to while others look things up in it.
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "Uring.h"
+
+#define MAX_REGISTERED 64
+
+struct registeredBuffer {
+	char                 *base;
+	unsigned long         length;
+};
+
+struct uring {
+	int                   fd;
+	
+	// Submission queue
+	uint                 *sqHead;
+	uint                 *sqTail;
+	uint                  sqMask;
+	uint                  sqEntries;
+	struct io_uring_sqe  *sqes;
+	uint                  sqeTail;   // Filled in up to here
+	uint                  submitted; // Handed to the kernel up to here
+	
+	// Completion queue
+	uint                 *cqHead;
+	uint                 *cqTail;
+	uint                  cqMask;
+	struct io_uring_cqe  *cqes;
+	
+	void                 *sqRing;
+	size_t                sqRingSize;
+	void                 *cqRing;
+	size_t                cqRingSize;
+	size_t                sqesSize;
+	
+	// Provided buffers
+	struct io_uring_buf_ring *bufRing;
+	size_t                bufRingSize;
+	char                 *buffers;
+	uint                  bufferSize;
+	uint                  bufMask;
+	uint                  bufTail;
+	
+	// Registered buffers
+	struct registeredBuffer registered[MAX_REGISTERED];
+	uint                  tableSize;
+	uint                  numRegistered;
+};
+
+static int enter(Uring ring, uint toSubmit, uint waitFor, uint flags);
+static int registerWith(Uring ring, uint opcode, void *arg, uint nArgs);
+static void addBuffer(Uring ring, uint bid);
+
+Uring newUring(uint entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CLAMP;
+	
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) return NULL;
+	
+	// Requests may point at memory that only lasts until they are
+	// submitted (a sendmsg's message, say)
+	if (!(params.features & IORING_FEAT_SUBMIT_STABLE)) {
+		close(fd);
+		return NULL;
+	}
+	
+	Uring ring = calloc(1, sizeof(struct uring));
+	if (ring == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (newUring)");
+	}
+	ring->fd = fd;
+	
+	// Map the rings. Newer kernels put both rings in one mapping.
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint);
+	ring->cqRingSize = params.cq_off.cqes +
+	                   params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize) {
+			ring->sqRingSize = ring->cqRingSize;
+		}
+		ring->cqRingSize = ring->sqRingSize;
+	}
+	
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		errx(EXIT_FAILURE, "Failed to map the submission queue");
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			errx(EXIT_FAILURE, "Failed to map the completion queue");
+		}
+	}
+	
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		errx(EXIT_FAILURE, "Failed to map the submission queue entries");
+	}
+	
+	char *sq = ring->sqRing;
+	ring->sqHead = (uint *)(sq + params.sq_off.head);
+	ring->sqTail = (uint *)(sq + params.sq_off.tail);
+	ring->sqMask = *(uint *)(sq + params.sq_off.ring_mask);
+	ring->sqEntries = params.sq_entries;
+	ring->sqeTail = *(ring->sqTail);
+	ring->submitted = ring->sqeTail;
+	
+	// Entry i of the submission queue is always sqes[i]
+	uint *array = (uint *)(sq + params.sq_off.array);
+	for (uint i = 0; i < params.sq_entries; i++) {
+		array[i] = i;
+	}
+	
+	char *cq = ring->cqRing;
+	ring->cqHead = (uint *)(cq + params.cq_off.head);
+	ring->cqTail = (uint *)(cq + params.cq_off.tail);
+	ring->cqMask = *(uint *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	
+	return ring;
+}
+
+// Closing the ring cancels whatever is still in flight
+void freeUring(Uring ring) {
+	close(ring->fd);
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	munmap(ring->sqRing, ring->sqRingSize);
+	if (ring->bufRing != NULL) {
+		munmap(ring->bufRing, ring->bufRingSize);
+		free(ring->buffers);
+	}
+	free(ring);
+}
+
+struct io_uring_sqe *getSqe(Uring ring) {
+	uint head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	while (ring->sqeTail - head >= ring->sqEntries) {
+		if (submitUring(ring) < 0) {
+			errx(EXIT_FAILURE, "Failed to submit to io_uring");
+		}
+		head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	}
+	
+	struct io_uring_sqe *sqe = &(ring->sqes[ring->sqeTail & ring->sqMask]);
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqeTail++;
+	return sqe;
+}
+
+int submitUring(Uring ring) {
+	__atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+	
+	int result = 0;
+	while (ring->submitted != ring->sqeTail) {
+		result = enter(ring, ring->sqeTail - ring->submitted, 0, 0);
+		if (result <= 0) break;
+		ring->submitted += result;
+	}
+	return (result < 0 ? result : 0);
+}
+
+// io_uring_enter goes through syscall(), so it isn't a cancellation
+// point. The thread is made asynchronously cancellable just while it
+// waits instead, which is what libc does for its own blocking calls.
+int waitUring(Uring ring, uint waitFor) {
+	int oldType;
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldType);
+	int result = enter(ring, 0, waitFor, IORING_ENTER_GETEVENTS);
+	pthread_setcanceltype(oldType, NULL);
+	return (result < 0 ? result : 0);
+}
+
+struct io_uring_cqe *peekCqe(Uring ring) {
+	uint head = *(ring->cqHead);
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &(ring->cqes[head & ring->cqMask]);
+}
+
+void seenCqe(Uring ring) {
+	__atomic_store_n(ring->cqHead, *(ring->cqHead) + 1, __ATOMIC_RELEASE);
+}
+
+int registerBufferTable(Uring ring, uint nBuffers) {
+	if (nBuffers > MAX_REGISTERED) nBuffers = MAX_REGISTERED;
+	
+	struct io_uring_rsrc_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = nBuffers;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	int result = registerWith(ring, IORING_REGISTER_BUFFERS2,
+	                          &reg, sizeof(reg));
+	if (result < 0) return result;
+	
+	ring->tableSize = nBuffers;
+	ring->numRegistered = 0;
+	return 0;
+}
+
+// The entry is filled in before the count is published, so lookups
+// never see a half-registered buffer
+int registerBuffer(Uring ring, void *base, unsigned long length) {
+	uint index = ring->numRegistered;
+	if (index == ring->tableSize) return -ENOSPC;
+	
+	struct iovec iov = { base, length };
+	struct io_uring_rsrc_update2 update;
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.data = (uint64_t)(uintptr_t)&iov;
+	update.nr = 1;
+	int result = registerWith(ring, IORING_REGISTER_BUFFERS_UPDATE,
+	                          &update, sizeof(update));
+	if (result < 0) return result;
+	
+	ring->registered[index].base = base;
+	ring->registered[index].length = length;
+	__atomic_store_n(&(ring->numRegistered), index + 1, __ATOMIC_RELEASE);
+	return index;
+}
+
+int findRegisteredBuffer(Uring ring, void *start, unsigned long length) {
+	char *from = start;
+	char *to = from + length;
+	uint n = __atomic_load_n(&(ring->numRegistered), __ATOMIC_ACQUIRE);
+	for (uint i = 0; i < n; i++) {
+		struct registeredBuffer *buffer = &(ring->registered[i]);
+		if (from >= buffer->base && to <= buffer->base + buffer->length) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int provideBuffers(Uring ring, uint group, uint nBuffers, uint bufferSize) {
+	ring->bufRingSize = nBuffers * sizeof(struct io_uring_buf);
+	ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufRing == MAP_FAILED) {
+		ring->bufRing = NULL;
+		return -ENOMEM;
+	}
+	
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+	reg.ring_entries = nBuffers;
+	reg.bgid = group;
+	int result = registerWith(ring, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (result < 0) {
+		munmap(ring->bufRing, ring->bufRingSize);
+		ring->bufRing = NULL;
+		return result;
+	}
+	
+	ring->buffers = malloc((size_t)nBuffers * bufferSize);
+	if (ring->buffers == NULL) {
+		errx(EXIT_FAILURE, "Insufficient memory! (provideBuffers)");
+	}
+	ring->bufferSize = bufferSize;
+	ring->bufMask = nBuffers - 1;
+	ring->bufTail = 0;
+	for (uint bid = 0; bid < nBuffers; bid++) {
+		addBuffer(ring, bid);
+	}
+	__atomic_store_n(&(ring->bufRing->tail), ring->bufTail, __ATOMIC_RELEASE);
+	
+	return 0;
+}
+
+void *getProvidedBuffer(Uring ring, struct io_uring_cqe *cqe) {
+	uint bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	return ring->buffers + (size_t)bid * ring->bufferSize;
+}
+
+void recycleBuffer(Uring ring, struct io_uring_cqe *cqe) {
+	addBuffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	__atomic_store_n(&(ring->bufRing->tail), ring->bufTail, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+static int enter(Uring ring, uint toSubmit, uint waitFor, uint flags) {
+	int result;
+	do {
+		result = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor,
+		                 flags, NULL, 0);
+	} while (result < 0 && errno == EINTR);
+	return (result < 0 ? -errno : result);
+}
+
+static int registerWith(Uring ring, uint opcode, void *arg, uint nArgs) {
+	int result = syscall(__NR_io_uring_register, ring->fd, opcode, arg, nArgs);
+	return (result < 0 ? -errno : result);
+}
+
+// Puts a buffer back on the ring, but doesn't publish it yet
+static void addBuffer(Uring ring, uint bid) {
+	struct io_uring_buf *buf = &(ring->bufRing->bufs[ring->bufTail & ring->bufMask]);
+	buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * ring->bufferSize);
+	buf->len = ring->bufferSize;
+	buf->bid = bid;
+	ring->bufTail++;
+}
@@ -0,0 +1,67 @@
+// Uring.h
+// Header file for the Uring ADT
+// A thin wrapper around an io_uring instance, made with the raw
+// system calls: a submission and a completion ring, a table of
+// registered buffers, and a ring of buffers provided for receives
+// Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
+// for the Simple Transport Protocol (COMP3331 18s2 Assignment)
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+typedef struct uring *Uring;
+
+typedef unsigned int uint;
+
+// Returns NULL if io_uring isn't available
+Uring newUring(uint entries);
+
+void freeUring(Uring ring);
+
+// Returns a zeroed submission queue entry. If the submission queue is
+// full, what is already on it is submitted first.
+struct io_uring_sqe *getSqe(Uring ring);
+
+// Submits everything on the submission queue without waiting.
+// Returns 0, or a negative errno.
+int submitUring(Uring ring);
+
+// Waits until there are at least waitFor completions. This isn't a
+// cancellation point, but the thread can be cancelled while it waits.
+// Returns 0, or a negative errno.
+int waitUring(Uring ring, uint waitFor);
+
+// Returns the next completion, or NULL if there are none
+struct io_uring_cqe *peekCqe(Uring ring);
+
+// Gives the completion returned by peekCqe back to the ring
+void seenCqe(Uring ring);
+
+// Sets aside a table of nBuffers registered buffers (at most 64), all
+// empty. Returns 0, or a negative errno.
+int registerBufferTable(Uring ring, uint nBuffers);
+
+// Registers the memory at base in the next free slot of the table.
+// Returns its index, or a negative errno (-ENOSPC if the table is
+// full). Only one thread may register buffers.
+int registerBuffer(Uring ring, void *base, unsigned long length);
+
+// Returns the index of the registered buffer that holds all of the
+// given memory, or -1 if there isn't one. Safe to call while another
+// thread registers buffers.
+int findRegisteredBuffer(Uring ring, void *start, unsigned long length);
+
+// Sets up a ring of nBuffers buffers of bufferSize bytes each, for
+// receives that select a buffer from group. nBuffers must be a power
+// of two. Returns 0, or a negative errno.
+int provideBuffers(Uring ring, uint group, uint nBuffers, uint bufferSize);
+
+// Returns the provided buffer a completion put its data in
+void *getProvidedBuffer(Uring ring, struct io_uring_cqe *cqe);
+
+// Gives the provided buffer a completion used back to the ring
+void recycleBuffer(Uring ring, struct io_uring_cqe *cqe);
+
+#endif
@@ -3,31 +3,120 @@
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
-// To run: ./receiver <port> <new filename>
+// To run: ./receiver [options] <port> <new filename>
 // Example: ./receiver 1834 new_file.pdf
+// Options:
+//   -k <connections>    take a file striped over this many connections
+//                       (from ./sender -k) on <port>, <port> + 1, ...,
+//                       writing each range where it goes in the file
+//   -s                  serve any number of senders at once; transfer n
+//                       is written to <new filename>.n
+//   -n <count>          with -s, exit once count transfers are done
+//                       (default: never)
+//   -w <workers>        with -s, split the connections over this many
+//                       workers, each with its own socket on the port
+//                       and its own core (default: 1)
+//   -b                  with -w, spread connections over the workers by
+//                       connection ID with a BPF program, rather than by
+//                       address
+//   -u                  receive and reply through io_uring, if the kernel
+//                       has it; not used with -s
+//   -d                  write each segment straight to its place in the
+//                       file as soon as it arrives, rather than holding
+//                       it until it is in order; not used with -s
 
 #include <err.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "ReceiverServer.h"
 #include "ReceiverSTP.h"
 
+#define MAX_IOV 64  // Segments written out at once
+
+int  parseOptions(int argc, char *argv[]);
 void checkArgs(int argc, char *argv[]);
 void setArgs(char *argv[]);
+int  openFile(char *filename);
+void receiveFile(ReceiverSTP rstp, char *filename);
+void waitForFile(ReceiverSTP rstp);
+void receiveNumberedFile(ReceiverSTP rstp, uint number, void *arg);
+void receiveStriped(void);
+void receiveRange(ReceiverSTP rstp, int fd);
+void *receiveStripe(void *arg);
+
+// One connection of a striped file
+struct stripe {
+	ReceiverSTP rstp;
+	int         fd;
+	char        logName[32];
+	pthread_t   thread;
+};
 
 int   RECEIVER_PORT;
 char *NEW_FILENAME;
 
+int   USE_URING = 0;
+int   SERVER = 0;
+int   MAX_TRANSFERS = 0;
+int   NUM_WORKERS = 1;
+int   STEER = 0;
+int   NUM_CONNECTIONS = 1;
+int   DIRECT = 0;
+
 int main(int argc, char *argv[]) {
 	// setbuf(stdout, NULL);
+	
+	// Skip past the options, keeping the program name
+	// in front of the positional arguments
+	int nOptions = parseOptions(argc, argv);
+	argv[nOptions] = argv[0];
+	argv += nOptions;
+	argc -= nOptions;
+	
 	checkArgs(argc, argv);
 	setArgs(argv);
 	
+	if (SERVER) {
+		if (USE_URING) {
+			warnx("io_uring isn't used by the server, ignoring -u");
+		}
+		if (NUM_CONNECTIONS > 1) {
+			warnx("the server takes whole files, ignoring -k");
+		}
+		if (DIRECT) {
+			warnx("the server doesn't write files directly, ignoring -d");
+		}
+		ReceiverServer server = newReceiverServer(RECEIVER_PORT, NUM_WORKERS,
+		                                          STEER);
+		serveConnections(server, MAX_TRANSFERS, receiveNumberedFile,
+		                 NEW_FILENAME);
+		freeReceiverServer(server);
+		return 0;
+	}
+	
+	if (NUM_CONNECTIONS > 1) {
+		receiveStriped();
+		return 0;
+	}
+	
 	ReceiverSTP rstp = newSTP(RECEIVER_PORT);
+	if (USE_URING) {
+		requestUring(rstp);
+	}
+	int fd = -1;
+	if (DIRECT) {
+		fd = openFile(NEW_FILENAME);
+		setFileSink(rstp, fd);
+	}
 	
 	////////////////////////////////////////////////////////////////////
 	// Establishment
@@ -36,17 +125,12 @@ int main(int argc, char *argv[]) {
 	
 	////////////////////////////////////////////////////////////////////
 	// File Transfer
-	char *data;
-	int nbytes;
-	
-	int fd = open(NEW_FILENAME, O_CREAT|O_RDWR|O_TRUNC);
-	while (1) {
-		nbytes = pullDataFromSTP(rstp, &data);
-		if (nbytes == 0) break;
-		write(fd, data, nbytes);
-		free(data);
+	if (DIRECT) {
+		waitForFile(rstp);
+		close(fd);
+	} else {
+		receiveFile(rstp, NEW_FILENAME);
 	}
-	close(fd);
 	
 	printf("About to teardown connection\n");
 	
@@ -58,11 +142,168 @@ int main(int argc, char *argv[]) {
 	return 0;
 }
 
+int openFile(char *filename) {
+	int fd = open(filename, O_CREAT|O_RDWR|O_TRUNC, 0644);
+	if (fd == -1) {
+		errx(EXIT_FAILURE, "Couldn't open %s", filename);
+	}
+	return fd;
+}
+
+// The data is written straight out of the segments it arrived in
+void receiveFile(ReceiverSTP rstp, char *filename) {
+	struct iovec iov[MAX_IOV];
+	int n;
+	
+	int fd = openFile(filename);
+	while (1) {
+		n = borrowDataFromSTP(rstp, iov, MAX_IOV);
+		if (n == 0) break;
+		ssize_t nbytes = 0;
+		for (int i = 0; i < n; i++) {
+			nbytes += iov[i].iov_len;
+		}
+		if (writev(fd, iov, n) != nbytes) {
+			errx(EXIT_FAILURE, "Write failed");
+		}
+		releaseDataToSTP(rstp);
+	}
+	close(fd);
+}
+
+// With -d, the STP writes the file itself, so there is nothing to do
+// but wait for the end of it
+void waitForFile(ReceiverSTP rstp) {
+	struct iovec iov[MAX_IOV];
+	while (borrowDataFromSTP(rstp, iov, MAX_IOV) > 0) {
+		releaseDataToSTP(rstp);
+	}
+}
+
+// With -s, each transfer gets a file of its own
+void receiveNumberedFile(ReceiverSTP rstp, uint number, void *arg) {
+	char *prefix = (char *)arg;
+	char filename[strlen(prefix) + 16];
+	sprintf(filename, "%s.%u", prefix, number);
+	receiveFile(rstp, filename);
+}
+
+// With -k, every connection writes its range straight to where it
+// goes in the one file
+void receiveStriped(void) {
+	int fd = openFile(NEW_FILENAME);
+	
+	struct stripe stripes[NUM_CONNECTIONS];
+	for (int i = 0; i < NUM_CONNECTIONS; i++) {
+		struct stripe *stripe = &stripes[i];
+		stripe->fd = fd;
+		stripe->rstp = newSTP(RECEIVER_PORT + i);
+		sprintf(stripe->logName, "Receiver_log.%d.txt", i);
+		setLogName(stripe->rstp, stripe->logName);
+		if (USE_URING) {
+			requestUring(stripe->rstp);
+		}
+		if (DIRECT) {
+			setFileSink(stripe->rstp, fd);
+		}
+	}
+	
+	for (int i = 0; i < NUM_CONNECTIONS; i++) {
+		pthread_create(&(stripes[i].thread), NULL, receiveStripe,
+		               &stripes[i]);
+	}
+	for (int i = 0; i < NUM_CONNECTIONS; i++) {
+		pthread_join(stripes[i].thread, NULL);
+	}
+	
+	close(fd);
+	printf("All %d connections terminated.\n", NUM_CONNECTIONS);
+}
+
+// Writes one range of a striped file to where it goes
+void receiveRange(ReceiverSTP rstp, int fd) {
+	off_t offset = getRangeOffset(rstp);
+	struct iovec iov[MAX_IOV];
+	int n;
+	while ((n = borrowDataFromSTP(rstp, iov, MAX_IOV)) > 0) {
+		ssize_t nbytes = 0;
+		for (int i = 0; i < n; i++) {
+			nbytes += iov[i].iov_len;
+		}
+		if (pwritev(fd, iov, n, offset) != nbytes) {
+			errx(EXIT_FAILURE, "Write failed");
+		}
+		offset += nbytes;
+		releaseDataToSTP(rstp);
+	}
+}
+
+// Thread for receiving one range of a striped file
+void *receiveStripe(void *arg) {
+	struct stripe *stripe = (struct stripe *)arg;
+	
+	establishSTP(stripe->rstp);
+	printf("Connection established.\n");
+	
+	if (DIRECT) {
+		waitForFile(stripe->rstp);
+	} else {
+		receiveRange(stripe->rstp, stripe->fd);
+	}
+	
+	teardownSTP(stripe->rstp);
+	printf("Connection terminated.\n");
+	return NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////
 
+// Returns the number of arguments taken up by options. getopt moves
+// the positional arguments to the end of argv.
+int parseOptions(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "bdk:n:suw:")) != -1) {
+		switch (opt) {
+		case 'b':
+			STEER = 1;
+			break;
+		case 'd':
+			DIRECT = 1;
+			break;
+		case 'k':
+			NUM_CONNECTIONS = atoi(optarg);
+			if (NUM_CONNECTIONS < 1) {
+				errx(EXIT_FAILURE, "%s: connections should be a positive integer", argv[0]);
+			}
+			break;
+		case 'n':
+			MAX_TRANSFERS = atoi(optarg);
+			if (MAX_TRANSFERS < 0) {
+				errx(EXIT_FAILURE, "%s: count should be a positive integer", argv[0]);
+			}
+			break;
+		case 's':
+			SERVER = 1;
+			break;
+		case 'u':
+			USE_URING = 1;
+			break;
+		case 'w':
+			NUM_WORKERS = atoi(optarg);
+			if (NUM_WORKERS < 1) {
+				errx(EXIT_FAILURE, "%s: workers should be a positive integer", argv[0]);
+			}
+			break;
+		default:
+			errx(EXIT_FAILURE, "Usage: %s [-k connections] [-s [-n count] [-w workers [-b]]] [-u] [-d] <port> <new filename>", argv[0]);
+		}
+	}
+	return optind - 1;
+}
+
 void checkArgs(int argc, char *argv[]) {
 	if (argc != 3)
-		errx(EXIT_FAILURE, "Usage: %s <port> <new filename>", argv[0]);
+		errx(EXIT_FAILURE, "Usage: %s [-k connections] [-s [-n count] [-w workers [-b]]] [-u] [-d] <port> <new filename>", argv[0]);
 	if (atoi(argv[1]) <= 1024)
 		errx(EXIT_FAILURE, "port should be an integer greater than 1024");
 }
@@ -3,18 +3,42 @@
 // Written by Kevin Luxa (z5074984 - k.luxa@student.unsw.edu.au)
 // for the Simple Transport Protocol (COMP3331 18s2 Assignment)
 
-// To run: ./sender <receiver_host_ip> <receiver_port> <file> <MWS> <MSS> <gamma> <pDrop> <pDuplicate> <pCorrupt> <pOrder> <maxOrder> <pDelay> <maxDelay> <seed>
+// To run: ./sender [options] <receiver_host_ip> <receiver_port> <file> <MWS> <MSS> <gamma> <pDrop> <pDuplicate> <pCorrupt> <pOrder> <maxOrder> <pDelay> <maxDelay> <seed>
 // Example: ./sender 127.0.0.1 1834 files/test0.pdf 1000 100 6 0 0 0 0 0 0 0 0
+// Options:
+//   -a <segments>       ask the receiver to only ACK every so many in-order
+//                       segments (delayed ACKs), or once the first has
+//                       waited -A ms; out-of-order segments are always
+//                       ACKed at once (default: 1, every segment)
+//   -A <ms>             the longest an ACK may be delayed (default: 40)
+//   -c <parity|crc32c>  checksum to ask the receiver for (default: parity)
+//   -C <newreno|cubic|none>
+//                       congestion control algorithm (default: newreno);
+//                       none always lets the whole MWS be in flight
+//   -e                  run the transfer on one thread, from an epoll
+//                       event loop; not used with -u
+//   -g                  let the kernel split bursts of full-sized segments
+//                       up (UDP GSO), if it can
+//   -k <connections>    split the file into this many ranges and send
+//                       them at once, over connections to <port>,
+//                       <port> + 1, ... (for ./receiver -k)
+//   -u                  send and receive through io_uring, if the kernel
+//                       has it
+//   -z                  send segments without the kernel copying them
+//                       (MSG_ZEROCOPY), if it can; not used with -u
 
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "Segment.h"
 #include "SenderSTP.h"
 
 typedef unsigned int uint;
@@ -34,18 +58,58 @@ float P_DELAY;
 uint  MAX_DELAY;
 uint  SEED;
 
+uint  CHECKSUM_TYPE = 0;
+char *CONGESTION_CONTROL = NULL;
+int   EVENT_LOOP = 0;
+int   SEGMENT_OFFLOAD = 0;
+int   USE_URING = 0;
+int   ZERO_COPY = 0;
+int   NUM_CONNECTIONS = 1;
+int   ACK_EVERY = 1;
+int   ACK_DELAY = 40;
+
+// One range of a striped file, and the connection it goes over
+struct stripe {
+	SenderSTP sstp;
+	int       fd;
+	off_t     start;
+	off_t     length;
+	char      logName[32];
+	pthread_t thread;
+};
+
+int  parseOptions(int argc, char *argv[]);
 void checkArgs(int argc, char *argv[]);
 void setArgs(char *argv[]);
+SenderSTP openConnection(uint port, char *logName);
+void sendStriped(void);
+void *sendStripe(void *arg);
 
 int main(int argc, char *argv[]) {
 	setbuf(stdout, NULL);
+	
+	// Skip past the options, keeping the program name
+	// in front of the positional arguments
+	int nOptions = parseOptions(argc, argv);
+	argv[nOptions] = argv[0];
+	argv += nOptions;
+	argc -= nOptions;
+	
 	checkArgs(argc, argv);
 	setArgs(argv);
 	srand(SEED);
 	
-	SenderSTP sstp = newSTP(RECEIVER_IP, RECEIVER_PORT, MWS, MSS, GAMMA,
-	                        P_DROP, P_DUPLICATE, P_CORRUPT, P_ORDER,
-	                        MAX_ORDER, P_DELAY, MAX_DELAY);
+	if (USE_URING && EVENT_LOOP) {
+		warnx("io_uring isn't used by the event loop, ignoring -u");
+		USE_URING = 0;
+	}
+	
+	if (NUM_CONNECTIONS > 1) {
+		sendStriped();
+		return 0;
+	}
+	
+	SenderSTP sstp = openConnection(RECEIVER_PORT, "Sender_log.txt");
 	
 	////////////////////////////////////////////////////////////////////
 	// Establishment
@@ -79,12 +143,160 @@ int main(int argc, char *argv[]) {
 	return 0;
 }
 
+// Sets up a connection to the given port with the options, but
+// doesn't establish it
+SenderSTP openConnection(uint port, char *logName) {
+	SenderSTP sstp = newSTP(RECEIVER_IP, port, MWS, MSS, GAMMA,
+	                        P_DROP, P_DUPLICATE, P_CORRUPT, P_ORDER,
+	                        MAX_ORDER, P_DELAY, MAX_DELAY);
+	setLogName(sstp, logName);
+	requestChecksumType(sstp, CHECKSUM_TYPE);
+	requestDelayedAcks(sstp, ACK_EVERY, ACK_DELAY);
+	if (CONGESTION_CONTROL != NULL &&
+			!setCongestionControl(sstp, CONGESTION_CONTROL)) {
+		errx(EXIT_FAILURE, "congestion control should be newreno, cubic or none");
+	}
+	if (SEGMENT_OFFLOAD && !requestSegmentOffload(sstp)) {
+		warnx("segmentation offload isn't supported, ignoring -g");
+	}
+	if (USE_URING) {
+		requestUring(sstp);
+	}
+	if (EVENT_LOOP) {
+		requestEventLoop(sstp);
+	}
+	if (ZERO_COPY && !requestZeroCopy(sstp)) {
+		warnx("zero-copy sends aren't supported, ignoring -z");
+	}
+	return sstp;
+}
+
+// With -k, the file is split into a range for each connection (a
+// whole number of segments long, apart from the last), and the ranges
+// are all sent at once, each from a thread of its own
+void sendStriped(void) {
+	int fd = open(FILENAME, O_RDONLY);
+	if (fd == -1) {
+		errx(EXIT_FAILURE, "Couldn't open %s", FILENAME);
+	}
+	struct stat st;
+	fstat(fd, &st);
+	
+	off_t rangeSize = (st.st_size + NUM_CONNECTIONS - 1) / NUM_CONNECTIONS;
+	rangeSize = (rangeSize + MSS - 1) / MSS * MSS;
+	
+	struct stripe stripes[NUM_CONNECTIONS];
+	for (int i = 0; i < NUM_CONNECTIONS; i++) {
+		struct stripe *stripe = &stripes[i];
+		stripe->fd = fd;
+		stripe->start = (i * rangeSize < st.st_size ? i * rangeSize
+		                                            : st.st_size);
+		stripe->length = (st.st_size - stripe->start < rangeSize ?
+		                  st.st_size - stripe->start : rangeSize);
+		
+		sprintf(stripe->logName, "Sender_log.%d.txt", i);
+		stripe->sstp = openConnection(RECEIVER_PORT + i, stripe->logName);
+		setRangeOffset(stripe->sstp, stripe->start);
+	}
+	
+	for (int i = 0; i < NUM_CONNECTIONS; i++) {
+		pthread_create(&(stripes[i].thread), NULL, sendStripe, &stripes[i]);
+	}
+	for (int i = 0; i < NUM_CONNECTIONS; i++) {
+		pthread_join(stripes[i].thread, NULL);
+	}
+	
+	close(fd);
+	printf("All %d connections terminated.\n", NUM_CONNECTIONS);
+}
+
+// Thread for sending one range of a striped file
+void *sendStripe(void *arg) {
+	struct stripe *stripe = (struct stripe *)arg;
+	
+	establishSTP(stripe->sstp);
+	printf("Connection established.\n");
+	
+	char data[MSS];
+	off_t sent = 0;
+	while (sent < stripe->length) {
+		size_t wanted = (stripe->length - sent < MSS ?
+		                 stripe->length - sent : MSS);
+		ssize_t nbytes = pread(stripe->fd, data, wanted,
+		                       stripe->start + sent);
+		if (nbytes <= 0) {
+			errx(EXIT_FAILURE, "Read failed");
+		}
+		pushDataToSTP(stripe->sstp, nbytes, data);
+		sent += nbytes;
+	}
+	
+	teardownSTP(stripe->sstp);
+	printf("Connection terminated.\n");
+	return NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////
 
+// Returns the number of arguments taken up by options. getopt moves
+// the positional arguments to the end of argv.
+int parseOptions(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "a:A:c:C:egk:uz")) != -1) {
+		switch (opt) {
+		case 'a':
+			ACK_EVERY = atoi(optarg);
+			if (ACK_EVERY < 1) {
+				errx(EXIT_FAILURE, "%s: segments should be a positive integer", argv[0]);
+			}
+			break;
+		case 'A':
+			ACK_DELAY = atoi(optarg);
+			if (ACK_DELAY < 0) {
+				errx(EXIT_FAILURE, "%s: ms should be a non-negative integer", argv[0]);
+			}
+			break;
+		case 'c':
+			if (strcmp(optarg, "crc32c") == 0) {
+				CHECKSUM_TYPE = CRC32C;
+			} else if (strcmp(optarg, "parity") == 0) {
+				CHECKSUM_TYPE = 0;
+			} else {
+				errx(EXIT_FAILURE, "%s: checksum should be parity or crc32c", argv[0]);
+			}
+			break;
+		case 'C':
+			CONGESTION_CONTROL = optarg;
+			break;
+		case 'e':
+			EVENT_LOOP = 1;
+			break;
+		case 'g':
+			SEGMENT_OFFLOAD = 1;
+			break;
+		case 'k':
+			NUM_CONNECTIONS = atoi(optarg);
+			if (NUM_CONNECTIONS < 1) {
+				errx(EXIT_FAILURE, "%s: connections should be a positive integer", argv[0]);
+			}
+			break;
+		case 'u':
+			USE_URING = 1;
+			break;
+		case 'z':
+			ZERO_COPY = 1;
+			break;
+		default:
+			errx(EXIT_FAILURE, "Usage: %s [-a segments [-A ms]] [-c parity|crc32c] [-C newreno|cubic|none] [-e] [-g] [-k connections] [-u] [-z] <ip> <port> <file> <MWS> <MSS> <gamma> <pDrop> <pDuplicate> <pCorrupt> <pOrder> <maxOrder> <pDelay> <maxDelay> <seed>", argv[0]);
+		}
+	}
+	return optind - 1;
+}
+
 void checkArgs(int argc, char *argv[]) {
 	char *progname = argv[0];
 	if (argc != 15)
-		errx(EXIT_FAILURE, "Usage: %s <ip> <port> <file> <MWS> <MSS> <gamma> <pDrop> <pDuplicate> <pCorrupt> <pOrder> <maxOrder> <pDelay> <maxDelay> <seed>", progname);
+		errx(EXIT_FAILURE, "Usage: %s [-a segments [-A ms]] [-c parity|crc32c] [-C newreno|cubic|none] [-e] [-g] [-k connections] [-u] [-z] <ip> <port> <file> <MWS> <MSS> <gamma> <pDrop> <pDuplicate> <pCorrupt> <pOrder> <maxOrder> <pDelay> <maxDelay> <seed>", progname);
 	if (atoi(argv[2]) <= 1024)
 		errx(EXIT_FAILURE, "%s: port should be an integer greater than 1024", progname);
 	struct stat buffer;